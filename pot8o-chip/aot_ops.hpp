@@ -120,13 +120,17 @@ public:
     inline T operator+=(const T& rhs) {
         return __atomic_fetch_add(&val, rhs, __ATOMIC_RELAXED);
     }
+    inline T Acquire() const {
+        return __atomic_load_n(&val, __ATOMIC_ACQUIRE);
+    }
 };
 
 class Interface {
     Frame frame_buffer;
 public:
-    Atomic<bool> keypad_state[16];
-    // actually twice the cycle count but the frontend can figure out that calculation
+    // bit n is set while key n is held down
+    Atomic<unsigned> keypad_state;
+    // instructions run, only added to every instruction_budget instructions
     Atomic<u64> cycle_count;
     Atomic<u8> delay_timer;
     Atomic<u8> sound_timer;
@@ -135,6 +139,16 @@ private:
     Atomic<bool> stop_flag;
 
 public:
+    Atomic<unsigned> event_count;
+    void (*wait_for_event)(Interface& interface, unsigned seen);
+    void (*wait_for_key)(Interface& interface);
+    void (*wait_for_tick)(Interface& interface);
+    u64 instruction_budget;
+
+    bool Stopping() const {
+        return stop_flag;
+    }
+
     void PushFrame(Frame& frame) {
         // TODO: figure out how to do this efficiently without missing frames at the end of the
         // program
@@ -142,132 +156,181 @@ public:
             __builtin_memcpy(&frame_buffer, &frame, sizeof(frame));
             send_frame = false;
         }
-        if (stop_flag);
     }
 };
 
+struct Snapshot {
+    u8 memory[0x1000];
+    u64 frame_buffer[32];
+    u8 V[16];
+    unsigned stack[16];
+    unsigned stack_ptr;
+    unsigned I;
+    unsigned program_counter;
+};
+
+// set by pot8o_main, never baked into the code so compiled objects can be cached and reloaded
+static Interface* interface;
 static u8 memory[0x1000];
 static u64 frame_buffer[32]{};
-static u8 V[16]{};
-static void* stack[16]{};
+// addresses of the CALLs waiting to be returned to, like Snapshot::stack
+static unsigned stack[16]{};
 static unsigned stack_ptr{};
-static unsigned I{};
-static unsigned rand = seed;
-static unsigned last_jump;
+static unsigned rand;
+// instructions run and not added to interface->cycle_count yet, counted once per block
+static u64 cycles;
+// interface->instruction_budget, which stays the same while the game runs
+static u64 budget;
+
+static void PublishCycles() {
+    interface->cycle_count += cycles;
+    cycles = 0;
+}
+
+// every jump, CALL and RET hands the count to the frontend once the budget is used up and only
+// then waits for the next tick if throttled and looks at the stop flag, so pot8o_main returns
+// within a budget of instructions of a stop
+#define SAFEPOINT()                                                                                \
+    if (__builtin_expect(cycles >= budget, 0)) {                                                   \
+        PublishCycles();                                                                           \
+        interface->wait_for_tick(*interface);                                                      \
+        if (interface->Stopping())                                                                 \
+            return 1;                                                                              \
+    }
+
+// V and I are locals of pot8o_main so LLVM can keep them in host registers, nothing outside of
+// the generated code ever looks at them
+// the opcodes that use them take them by reference and get inlined
+#define REGISTERS u8(&V)[16], unsigned& I
+
+static void Restore(const Snapshot& snapshot, REGISTERS) {
+    __builtin_memcpy(memory, snapshot.memory, sizeof(memory));
+    __builtin_memcpy(frame_buffer, snapshot.frame_buffer, sizeof(frame_buffer));
+    __builtin_memcpy(V, snapshot.V, sizeof(V));
+    __builtin_memcpy(stack, snapshot.stack, sizeof(stack));
+    stack_ptr = snapshot.stack_ptr;
+    I = snapshot.I;
+}
 
 namespace Opcodes {
 void CLS() {
     for (auto& row : frame_buffer)
         row = 0;
-    interface.PushFrame(frame_buffer);
+    interface->PushFrame(frame_buffer);
 }
 
 #define RET(pc)                                                                                    \
-    interface.cycle_count += pc - last_jump;                                                       \
-    goto* stack[--stack_ptr];
-
-#define JP_addr(pc, addr)                                                                          \
-    interface.cycle_count += pc - last_jump;                                                       \
-    last_jump = addr;                                                                              \
-    goto* jump_table[addr];
-
-#define CALL_addr(pc, addr)                                                                        \
-    interface.cycle_count += pc - last_jump;                                                       \
-    last_jump = addr;                                                                              \
-    stack[stack_ptr++] = &&l##pc##_ret;                                                            \
-    goto* jump_table[addr];                                                                        \
-    l##pc##_ret:                                                                                   \
-    last_jump = pc + 2;                                                                            \
-
-#define SE_Vx_byte(pc, x, byte)                                                                    \
-    if (V[x] == byte)                                                                              \
-        goto* jump_table[pc + 4];
-
-#define SNE_Vx_byte(pc, x, byte)                                                                   \
-    if (V[x] != byte)                                                                              \
-        goto* jump_table[pc + 4];
-
-#define SE_Vx_Vy(pc, x, y)                                                                         \
-    if (V[x] == V[y])                                                                              \
-        goto* jump_table[pc + 4];
+    SAFEPOINT();                                                                                   \
+    goto return_dispatch;
+
+#define JP_addr(pc, addr, label)                                                                   \
+    SAFEPOINT();                                                                                   \
+    goto label;
+
+#define CALL_addr(pc, addr, label)                                                                 \
+    SAFEPOINT();                                                                                   \
+    stack[stack_ptr++] = pc;                                                                       \
+    goto label;                                                                                    \
+    l##pc##_ret:;
+
+// skips take LIKELY or UNLIKELY as their hint when the profile of the game is sure about them,
+// nothing otherwise
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#define UNLIKELY(condition) __builtin_expect(!!(condition), 0)
+
+#define SE_Vx_byte(skip, x, byte, hint)                                                            \
+    if (hint(V[x] == byte))                                                                        \
+        goto skip;
+
+#define SNE_Vx_byte(skip, x, byte, hint)                                                           \
+    if (hint(V[x] != byte))                                                                        \
+        goto skip;
+
+#define SE_Vx_Vy(skip, x, y, hint)                                                                 \
+    if (hint(V[x] == V[y]))                                                                        \
+        goto skip;
 
 template <unsigned x, u8 byte>
-void LD_Vx_byte() {
+void LD_Vx_byte(REGISTERS) {
     V[x] = byte;
 }
 
 template <unsigned x, u8 byte>
-void ADD_Vx_byte() {
+void ADD_Vx_byte(REGISTERS) {
     V[x] += byte;
 }
 
 template <unsigned x, unsigned y>
-void LD_Vx_Vy() {
+void LD_Vx_Vy(REGISTERS) {
     V[x] = V[y];
 }
 
 template <unsigned x, unsigned y>
-void OR_Vx_Vy() {
+void OR_Vx_Vy(REGISTERS) {
     V[x] |= V[y];
 }
 
 template <unsigned x, unsigned y>
-void AND_Vx_Vy() {
+void AND_Vx_Vy(REGISTERS) {
     V[x] &= V[y];
 }
 
 template <unsigned x, unsigned y>
-void XOR_Vx_Vy() {
+void XOR_Vx_Vy(REGISTERS) {
     V[x] ^= V[y];
 }
 
 template <unsigned x, unsigned y>
-void ADD_Vx_Vy() {
+void ADD_Vx_Vy(REGISTERS) {
     V[x] = __builtin_addcb(V[x], V[y], 0, &V[0xF]);
 }
 
 template <unsigned x, unsigned y>
-void SUB_Vx_Vy() {
+void SUB_Vx_Vy(REGISTERS) {
     u8 flag;
     V[x] = __builtin_subcb(V[x], V[y], 0, &flag);
     V[0xF] = !flag;
 }
 
 template <unsigned x>
-void SHR_Vx() {
+void SHR_Vx(REGISTERS) {
     V[0xF] = V[x] & 0b0000001;
     V[x] >>= 1;
 }
 
 template <unsigned x, unsigned y>
-void SUBN_Vx_Vy() {
+void SUBN_Vx_Vy(REGISTERS) {
     u8 flag;
     V[x] = __builtin_subcb(V[y], V[x], 0, &flag);
     V[0xF] = !flag;
 }
 
 template <unsigned x>
-void SHL_Vx() {
+void SHL_Vx(REGISTERS) {
     V[0xF] = V[x] >> 7;
     V[x] <<= 1;
 }
 
-#define SNE_Vx_Vy(pc, x, y)                                                                         \
-    if (V[x] != V[y])                                                                              \
-        goto* jump_table[pc + 4];
+#define SNE_Vx_Vy(skip, x, y, hint)                                                                \
+    if (hint(V[x] != V[y]))                                                                        \
+        goto skip;
 
 template <unsigned addr>
-void LD_I_addr() {
+void LD_I_addr(REGISTERS) {
     I = addr;
 }
 
-#define JP_V0_addr(pc, addr)                                                                       \
-    interface.cycle_count += pc - last_jump;                                                       \
-    last_jump = addr + V[0x0];                                                                     \
-    goto* jump_table[addr + V[0x0]];
+// cases is a list of case labels for every address V0 can reach, the rest end the game
+#define JP_V0_addr(pc, addr, cases)                                                                \
+    SAFEPOINT();                                                                                   \
+    switch (addr + V[0x0]) {                                                                       \
+    cases                                                                                          \
+    default:                                                                                       \
+        goto end_loop;                                                                             \
+    }
 
 template <unsigned x, u8 byte>
-void RND_Vx_byte() {
+void RND_Vx_byte(REGISTERS) {
     rand ^= rand << 13;
     rand ^= rand >> 17;
     rand ^= rand << 5;
@@ -275,8 +338,8 @@ void RND_Vx_byte() {
 }
 
 template <unsigned x, unsigned y, unsigned height>
-void DRW_Vx_Vy_nibble() {
-    const auto left = V[x] + 7;
+void DRW_Vx_Vy_nibble(REGISTERS) {
+    const auto left = V[x] + 8;
     const auto top = V[y];
     u64 flag = 0;
 
@@ -288,53 +351,72 @@ void DRW_Vx_Vy_nibble() {
     }
     V[0xF] = static_cast<bool>(flag);
 
-    interface.PushFrame(frame_buffer);
+    interface->PushFrame(frame_buffer);
 }
 
-#define SKP_Vx(pc, x)                                                                              \
-    if (interface.keypad_state[V[x]])                                                              \
-        goto* jump_table[pc + 4];
+#define SKP_Vx(skip, x, hint)                                                                      \
+    if (hint(interface->keypad_state >> (V[x] & 0xF) & 1))                                         \
+        goto skip;
 
-#define SKNP_Vx(pc, x)                                                                             \
-    if (!interface.keypad_state[V[x]])                                                             \
-        goto* jump_table[pc + 4];
+#define SKNP_Vx(skip, x, hint)                                                                     \
+    if (hint(!(interface->keypad_state >> (V[x] & 0xF) & 1)))                                      \
+        goto skip;
 
 template <unsigned x>
-void LD_Vx_DT() {
-    V[x] = interface.delay_timer;
+void LD_Vx_DT(REGISTERS) {
+    V[x] = interface->delay_timer;
 }
 
+// LD Vx, DT; SE/SNE Vx, byte; JP back to the LD, parked on the timer thread instead of spinning
+template <unsigned x, u8 byte, bool equal>
+void LD_Vx_DT_idle(REGISTERS) {
+    for (;;) {
+        const unsigned seen = interface->event_count.Acquire();
+        V[x] = interface->delay_timer;
+        if ((V[x] == byte) == equal || interface->Stopping())
+            return;
+        PublishCycles();
+        interface->wait_for_event(*interface, seen);
+    }
+}
+
+// false if a stop cut the wait short, V[x] stays as it was and pot8o_main returns like the
+// Interpreter does
 template <unsigned x>
-void LD_Vx_K() {
-    V[x] = [] {
-        for (auto i = 0;; i = (i + 1) % (sizeof(interface.keypad_state) / sizeof(Atomic<bool>)))
-            if (interface.keypad_state[i])
-                return i;
-    }();
+bool LD_Vx_K(REGISTERS) {
+    unsigned keys;
+    while (!(keys = interface->keypad_state)) {
+        PublishCycles();
+        if (interface->Stopping())
+            return false;
+        interface->wait_for_key(*interface);
+    }
+    V[x] = __builtin_ctz(keys);
+    return true;
 }
 
 template <unsigned x>
-void LD_DT_Vx() {
-    interface.delay_timer = V[x];
+void LD_DT_Vx(REGISTERS) {
+    interface->delay_timer = V[x];
 }
 
 template <unsigned x>
-void LD_ST_Vx() {
-    interface.sound_timer = V[x];
+void LD_ST_Vx(REGISTERS) {
+    interface->sound_timer = V[x];
 }
 
 template <unsigned x>
-void ADD_I_Vx() {
+void ADD_I_Vx(REGISTERS) {
     I += V[x];
 }
 
 template <unsigned x>
-void LD_F_Vx() {
+void LD_F_Vx(REGISTERS) {
     I = V[x] * 5;
 }
 
 template <unsigned x>
-void LD_B_Vx() {
+void LD_B_Vx(REGISTERS) {
     auto num = V[x];
     memory[I] = num / 100;
     num %= 100;
@@ -344,13 +426,13 @@ void LD_B_Vx() {
 }
 
 template <unsigned x>
-void LD_I_Vx() {
+void LD_I_Vx(REGISTERS) {
     for (auto i = 0; i <= x; i++)
         memory[I + i] = V[i];
 }
 
 template <unsigned x>
-void LD_Vx_I() {
+void LD_Vx_I(REGISTERS) {
     for (auto i = 0; i <= x; i++)
         V[i] = memory[I + i];
 }
@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <cassert>
+
+#include "batch_interpreter.hpp"
+#include "font.hpp"
+
+// _rotr64 without the MSVC intrinsic header, compilers turn it into a rotate
+static inline std::uint64_t RotateRight(std::uint64_t value, unsigned shift) {
+    shift &= 63;
+    return value >> shift | value << ((64 - shift) & 63);
+}
+
+void BatchInterpreter::Run(const std::vector<std::uint32_t>& seeds, std::uint64_t ticks,
+                           const std::vector<std::vector<Chip8::KeyEvent>>& input,
+                           const FrameCallback& on_frame) {
+    assert(input.size() <= 1 || input.size() == seeds.size());
+    this->ticks = ticks;
+    this->input = &input;
+    this->on_frame = &on_frame;
+    Reset(seeds);
+
+    for (std::size_t lane = 0; lane < lanes; lane++)
+        Replay(lane);
+
+    for (;;) {
+        addresses.clear();
+        std::size_t running = 0, scheduled = 0;
+        for (std::uint32_t lane = 0; lane < lanes; lane++) {
+            if (state[lane] == State::Waiting) {
+                // a tick per step until a key comes in, like the wait loop of the Interpreter
+                Tick(lane);
+                LD_Vx_K(lane, Fetch(lane, program_counter[lane]) >> 8 & 0xF);
+            }
+            if (state[lane] != State::Running && state[lane] != State::Waiting)
+                continue;
+            // stop lanes like Interpreter::Execute does at the next instruction boundary
+            if (program_counter[lane] >= 0x1000) {
+                state[lane] = State::Ended;
+                continue;
+            }
+            if (ticks_run[lane] == ticks) {
+                state[lane] = State::Done;
+                continue;
+            }
+            running++;
+            if (state[lane] == State::Waiting)
+                continue;
+            const auto address = program_counter[lane];
+            if (first_lane[address] == NO_LANE)
+                addresses.push_back(static_cast<std::uint16_t>(address));
+            next_lane[lane] = first_lane[address];
+            first_lane[address] = lane;
+            scheduled++;
+        }
+        if (running == 0)
+            break;
+
+        for (const auto address : addresses) {
+            const auto next = (address + 1) & 0xFFF;
+            // nobody wrote to the code here, so every lane has the same instruction
+            const bool shared = !written[address] && !written[next];
+            group_lanes.clear();
+            if (!shared || scheduled != lanes || addresses.size() != 1)
+                for (auto lane = first_lane[address]; lane != NO_LANE; lane = next_lane[lane])
+                    group_lanes.push_back(lane);
+            first_lane[address] = NO_LANE;
+            if (shared) {
+                const auto count = group_lanes.empty() ? lanes : group_lanes.size();
+                Execute(image[address] << 8 | image[next],
+                        {group_lanes.data(), count, count == lanes});
+                continue;
+            }
+            // lanes that wrote different code here run it separately
+            auto begin = group_lanes.begin();
+            while (begin != group_lanes.end()) {
+                const auto opcode = Fetch(*begin, address);
+                const auto end = std::partition(begin, group_lanes.end(), [&](auto lane) {
+                    return Fetch(lane, address) == opcode;
+                });
+                const auto count = static_cast<std::size_t>(end - begin);
+                Execute(opcode, {&*begin, count, count == lanes});
+                begin = end;
+            }
+        }
+    }
+}
+
+Chip8::Snapshot BatchInterpreter::GetSnapshot(std::size_t lane) const {
+    Chip8::Snapshot snapshot{};
+    snapshot.memory = memory[lane];
+    for (std::size_t row = 0; row < frame_buffer.size(); row++)
+        snapshot.frame_buffer[row] = frame_buffer[row][lane];
+    for (std::size_t x = 0; x < V.size(); x++)
+        snapshot.V[x] = V[x][lane];
+    snapshot.stack_ptr = stack_ptr[lane];
+    for (std::size_t depth = 0; depth < stack_ptr[lane]; depth++)
+        snapshot.stack[depth] = stack[depth][lane];
+    snapshot.I = I[lane];
+    snapshot.program_counter = program_counter[lane];
+    return snapshot;
+}
+
+void BatchInterpreter::Reset(const std::vector<std::uint32_t>& seeds) {
+    lanes = seeds.size();
+    state.assign(lanes, State::Running);
+    for (auto& registers : V)
+        registers.assign(lanes, 0);
+    I.assign(lanes, 0);
+    program_counter.assign(lanes, 0x200);
+    for (auto& depth : stack)
+        depth.assign(lanes, 0);
+    stack_ptr.assign(lanes, 0);
+    delay_timer.assign(lanes, 0);
+    sound_timer.assign(lanes, 0);
+    keypad_state.assign(lanes, 0);
+    for (auto& row : frame_buffer)
+        row.assign(lanes, 0);
+    collision.assign(lanes, 0);
+    sprite_rows.assign(15 * lanes, 0);
+    placed_rows.assign(frame_buffer.size() * lanes, 0);
+
+    image.fill(0);
+    std::copy(FONT.begin(), FONT.end(), image.begin());
+    std::copy_n(game.begin(), std::min<std::size_t>(game.size(), image.size() - 0x200),
+                image.begin() + 0x200);
+    memory.assign(lanes, image);
+    written.fill(false);
+
+    shown.assign(lanes, {});
+    send_frame.assign(lanes, true);
+    cycles.assign(lanes, 0);
+    instructions.assign(lanes, 0);
+    ticks_run.assign(lanes, 0);
+    next_input.assign(lanes, 0);
+    rng.clear();
+    for (const auto seed : seeds)
+        rng.emplace_back(seed);
+
+    first_lane.fill(NO_LANE);
+    next_lane.assign(lanes, NO_LANE);
+    groups = 0;
+    lane_steps = 0;
+}
+
+void BatchInterpreter::Execute(std::uint16_t opcode, const Group& group) {
+    const std::uint8_t x = (opcode & 0x0F00) >> 8;
+    const std::uint8_t y = (opcode & 0x00F0) >> 4;
+    const std::uint8_t n = opcode & 0x000F;
+    const std::uint8_t kk = opcode & 0x00FF;
+    const std::uint16_t nnn = opcode & 0x0FFF;
+    auto* const vx = V[x].data();
+    auto* const vy = V[y].data();
+    auto* const vf = V[0xF].data();
+    auto* const pc = program_counter.data();
+    const auto step = [&](std::size_t lane) { pc[lane] += 2; };
+    groups++;
+    lane_steps += group.count;
+
+    // counted before running the instruction, so a tick comes first when the budget runs out
+    // Counting vectorizes, the lanes whose budget ran out tick in a pass of their own after it
+    auto* const cycle = cycles.data();
+    const auto budget = instructions_per_tick;
+    unsigned due = 0;
+    Each(group, [&](std::size_t lane) { due |= ++cycle[lane] >= budget; });
+    if (due)
+        Each(group, [&](std::size_t lane) {
+            if (cycle[lane] < budget)
+                return;
+            instructions[lane] += cycle[lane];
+            cycle[lane] = 0;
+            Tick(lane);
+        });
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (kk == 0xE0) {
+            // Clear the display
+            for (auto& row : frame_buffer)
+                Each(group, [&](std::size_t lane) { row[lane] = 0; });
+            Each(group, step);
+            Each(group, [&](std::size_t lane) { Show(lane); });
+        } else if (kk == 0xEE) {
+            // Return from a subroutine
+            Each(group, [&](std::size_t lane) {
+                if (stack_ptr[lane] == 0) {
+                    state[lane] = State::Ended;
+                    return;
+                }
+                pc[lane] = stack[--stack_ptr[lane]][lane] + 2;
+            });
+        } else {
+            Each(group, step);
+        }
+        break;
+    case 0x1:
+        Each(group, [&](std::size_t lane) { pc[lane] = nnn; });
+        break;
+    case 0x2:
+        Each(group, [&](std::size_t lane) {
+            if (stack_ptr[lane] == STACK_SIZE) {
+                state[lane] = State::Ended;
+                return;
+            }
+            stack[stack_ptr[lane]++][lane] = static_cast<std::uint16_t>(pc[lane]);
+            pc[lane] = nnn;
+        });
+        break;
+    case 0x3:
+        Each(group, [&](std::size_t lane) { pc[lane] += vx[lane] == kk ? 4 : 2; });
+        break;
+    case 0x4:
+        Each(group, [&](std::size_t lane) { pc[lane] += vx[lane] != kk ? 4 : 2; });
+        break;
+    case 0x5:
+        Each(group, [&](std::size_t lane) { pc[lane] += vx[lane] == vy[lane] ? 4 : 2; });
+        break;
+    case 0x6:
+        Each(group, [&](std::size_t lane) {
+            vx[lane] = kk;
+            step(lane);
+        });
+        break;
+    case 0x7:
+        Each(group, [&](std::size_t lane) {
+            vx[lane] += kk;
+            step(lane);
+        });
+        break;
+    case 0x8:
+        // VF is written in the same order as the Interpreter does, for when x or y is F
+        switch (n) {
+        case 0x0:
+            Each(group, [&](std::size_t lane) { vx[lane] = vy[lane]; });
+            break;
+        case 0x1:
+            Each(group, [&](std::size_t lane) { vx[lane] |= vy[lane]; });
+            break;
+        case 0x2:
+            Each(group, [&](std::size_t lane) { vx[lane] &= vy[lane]; });
+            break;
+        case 0x3:
+            Each(group, [&](std::size_t lane) { vx[lane] ^= vy[lane]; });
+            break;
+        case 0x4:
+            Each(group, [&](std::size_t lane) {
+                const std::uint16_t result = vx[lane] + vy[lane];
+                vf[lane] = result > 0xFF;
+                vx[lane] = static_cast<std::uint8_t>(result & 0xFF);
+            });
+            break;
+        case 0x5:
+            Each(group, [&](std::size_t lane) {
+                vf[lane] = vx[lane] > vy[lane];
+                vx[lane] -= vy[lane];
+            });
+            break;
+        case 0x6:
+            Each(group, [&](std::size_t lane) {
+                vf[lane] = vx[lane] & 0b0000001;
+                vx[lane] >>= 1;
+            });
+            break;
+        case 0x7:
+            Each(group, [&](std::size_t lane) {
+                vf[lane] = vy[lane] > vx[lane];
+                vx[lane] = vy[lane] - vx[lane];
+            });
+            break;
+        case 0xE:
+            Each(group, [&](std::size_t lane) {
+                vf[lane] = (vx[lane] & 0b1000000) >> 7;
+                vx[lane] <<= 1;
+            });
+            break;
+        }
+        Each(group, step);
+        break;
+    case 0x9:
+        Each(group, [&](std::size_t lane) { pc[lane] += vx[lane] != vy[lane] ? 4 : 2; });
+        break;
+    case 0xA:
+        Each(group, [&](std::size_t lane) {
+            I[lane] = nnn;
+            step(lane);
+        });
+        break;
+    case 0xB:
+        Each(group, [&](std::size_t lane) { pc[lane] = nnn + V[0x0][lane]; });
+        break;
+    case 0xC:
+        Each(group, [&](std::size_t lane) {
+            vx[lane] = dist(rng[lane]) & kk;
+            step(lane);
+        });
+        break;
+    case 0xD: {
+        // Display n-byte sprite starting at memory location I at (V[x], V[y]), set VF = collision
+        // The rows come out of the memory of each lane first, then every pass draws one of them on
+        // one frame row of every lane
+        auto* const sprites = sprite_rows.data();
+        auto* const hit = collision.data();
+        const auto stride = lanes;
+        for (std::size_t row = 0; row < n; row++)
+            Each(group, [&](std::size_t lane) {
+                sprites[row * stride + lane] = memory[lane][(I[lane] + row) & 0xFFF];
+            });
+        for (std::size_t row = 0; row < n; row++) {
+            auto* const sprite_row = sprites + row * stride;
+            Each(group, [&](std::size_t lane) {
+                sprite_row[lane] = RotateRight(sprite_row[lane], vx[lane] + 8u);
+            });
+        }
+        // whether any lane draws at other rows than the first one
+        const unsigned top = vy[group.all ? 0 : group.lanes[0]] % 32;
+        unsigned apart = 0;
+        Each(group, [&](std::size_t lane) {
+            hit[lane] = 0;
+            apart |= (vy[lane] ^ top) & 31;
+        });
+        if (!apart) {
+            for (std::size_t row = 0; row < n; row++) {
+                auto* const fb_row = frame_buffer[(top + row) % 32].data();
+                auto* const sprite_row = sprites + row * stride;
+                Each(group, [&](std::size_t lane) {
+                    hit[lane] |= fb_row[lane] & sprite_row[lane];
+                    fb_row[lane] ^= sprite_row[lane];
+                });
+            }
+        } else {
+            // put every row at the frame row the lane draws it at, then draw a frame row per pass
+            auto* const placed = placed_rows.data();
+            Each(group, [&](std::size_t lane) {
+                for (std::size_t row = 0; row < n; row++)
+                    placed[(vy[lane] + row) % 32 * stride + lane] = sprites[row * stride + lane];
+            });
+            for (std::size_t target = 0; target < frame_buffer.size(); target++) {
+                auto* const fb_row = frame_buffer[target].data();
+                auto* const placed_row = placed + target * stride;
+                Each(group, [&](std::size_t lane) {
+                    hit[lane] |= fb_row[lane] & placed_row[lane];
+                    fb_row[lane] ^= placed_row[lane];
+                    placed_row[lane] = 0;
+                });
+            }
+        }
+        Each(group, [&](std::size_t lane) {
+            vf[lane] = static_cast<bool>(hit[lane]);
+            step(lane);
+        });
+        Each(group, [&](std::size_t lane) { Show(lane); });
+        break;
+    }
+    case 0xE: {
+        const auto* const keys = keypad_state.data();
+        if (kk == 0x9E)
+            Each(group, [&](std::size_t lane) {
+                pc[lane] += keys[lane] & 1u << (vx[lane] & 0xF) ? 4 : 2;
+            });
+        else if (kk == 0xA1)
+            Each(group, [&](std::size_t lane) {
+                pc[lane] += keys[lane] & 1u << (vx[lane] & 0xF) ? 2 : 4;
+            });
+        else
+            Each(group, step);
+        break;
+    }
+    case 0xF:
+        switch (kk) {
+        case 0x07:
+            Each(group, [&](std::size_t lane) { vx[lane] = delay_timer[lane]; });
+            break;
+        case 0x0A:
+            // LD_Vx_K moves on by itself once there is a key
+            Each(group, [&](std::size_t lane) { LD_Vx_K(lane, x); });
+            return;
+        case 0x15:
+            Each(group, [&](std::size_t lane) { delay_timer[lane] = vx[lane]; });
+            break;
+        case 0x18:
+            Each(group, [&](std::size_t lane) { sound_timer[lane] = vx[lane]; });
+            break;
+        case 0x1E:
+            Each(group, [&](std::size_t lane) { I[lane] += vx[lane]; });
+            break;
+        case 0x29:
+            Each(group, [&](std::size_t lane) { I[lane] = vx[lane] * 5; });
+            break;
+        case 0x33:
+            Each(group, [&](std::size_t lane) {
+                auto& ram = memory[lane];
+                std::uint8_t num = vx[lane];
+                ram[I[lane] & 0xFFF] = num / 100;
+                num %= 100;
+                ram[(I[lane] + 1) & 0xFFF] = num / 10;
+                num %= 10;
+                ram[(I[lane] + 2) & 0xFFF] = num;
+                for (std::size_t i = 0; i < 3; i++)
+                    written[(I[lane] + i) & 0xFFF] = true;
+            });
+            break;
+        case 0x55:
+            for (std::size_t r = 0; r <= x; r++)
+                Each(group, [&](std::size_t lane) {
+                    memory[lane][(I[lane] + r) & 0xFFF] = V[r][lane];
+                    written[(I[lane] + r) & 0xFFF] = true;
+                });
+            break;
+        case 0x65:
+            for (std::size_t r = 0; r <= x; r++)
+                Each(group, [&](std::size_t lane) {
+                    V[r][lane] = memory[lane][(I[lane] + r) & 0xFFF];
+                });
+            break;
+        }
+        Each(group, step);
+        break;
+    }
+}
+
+void BatchInterpreter::Tick(std::size_t lane) {
+    // lanes can run into one more instruction before they notice their ticks are up
+    if (ticks_run[lane] == ticks)
+        return;
+    ticks_run[lane]++;
+    if (delay_timer[lane])
+        delay_timer[lane]--;
+    if (sound_timer[lane])
+        sound_timer[lane]--;
+    Replay(lane);
+    (*on_frame)(lane, ticks_run[lane], shown[lane]);
+    send_frame[lane] = true;
+}
+
+void BatchInterpreter::LD_Vx_K(std::size_t lane, std::uint8_t x) {
+    if (const std::uint16_t keys = keypad_state[lane]) {
+        std::uint8_t key = 0;
+        while (!(keys >> key & 1))
+            key++;
+        V[x][lane] = key;
+        program_counter[lane] += 2;
+        state[lane] = State::Running;
+        return;
+    }
+    // the instructions so far don't count towards the tick after the wait
+    if (state[lane] == State::Running) {
+        instructions[lane] += cycles[lane];
+        cycles[lane] = 0;
+        state[lane] = State::Waiting;
+    }
+}
+
+void BatchInterpreter::Show(std::size_t lane) {
+    if (!send_frame[lane])
+        return;
+    for (std::size_t row = 0; row < frame_buffer.size(); row++)
+        shown[lane][row] = frame_buffer[row][lane];
+    send_frame[lane] = false;
+}
+
+void BatchInterpreter::Replay(std::size_t lane) {
+    if (input->empty())
+        return;
+    const auto& events = (*input)[input->size() == 1 ? 0 : lane];
+    for (auto& next = next_input[lane];
+         next < events.size() && events[next].tick <= ticks_run[lane]; next++) {
+        if (events[next].down)
+            keypad_state[lane] |= 1u << events[next].key;
+        else
+            keypad_state[lane] &= ~(1u << events[next].key);
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "chip8.hpp"
+
+// Runs many copies of one game in lockstep in virtual time, for searches and fuzzing that try the
+// same game with different seeds and input
+// Every register, timer, stack and frame row is an array with an element per copy, a lane, and
+// every step runs one instruction on each lane. Lanes at the same address with the same opcode
+// there run it together in a loop over lanes. While every lane runs it that loop goes over the
+// arrays in order, which the compiler vectorizes for the target it builds for, so build this with
+// POT8O_NATIVE or -march to get AVX2 or AVX-512. Each lane gives the same frames and instruction
+// counts Chip8::RunVirtual gives on the Interpreter without superinstructions
+class BatchInterpreter {
+public:
+    using FrameCallback =
+        std::function<void(std::size_t lane, std::uint64_t tick, const Chip8::Frame& frame)>;
+
+    BatchInterpreter(std::vector<std::uint8_t> game, std::uint64_t instructions_per_tick)
+        : game{std::move(game)}, instructions_per_tick{instructions_per_tick} {}
+
+    // Run the game from the start on a lane per seed until ticks ticks went by or it ended,
+    // replaying input[lane], or input[0] on every lane, and handing the frame of every tick to
+    // on_frame
+    void Run(const std::vector<std::uint32_t>& seeds, std::uint64_t ticks,
+             const std::vector<std::vector<Chip8::KeyEvent>>& input,
+             const FrameCallback& on_frame);
+
+    // instructions the lane ran in the last Run
+    std::uint64_t GetInstructions(std::size_t lane) const {
+        return instructions[lane] + cycles[lane];
+    }
+    // whether the lane left memory, or called or returned past its stack, before its ticks were up
+    bool Ended(std::size_t lane) const {
+        return state[lane] == State::Ended;
+    }
+    Chip8::Snapshot GetSnapshot(std::size_t lane) const;
+    // how many lanes ran each instruction on average, as many as there are lanes while they all
+    // stay at the same address
+    double GetLanesPerGroup() const {
+        return groups ? static_cast<double>(lane_steps) / groups : 0;
+    }
+
+private:
+    static constexpr std::uint32_t NO_LANE = ~0u;
+    static constexpr std::size_t STACK_SIZE = 16;
+
+    // Running, Waiting on a key, Done once its ticks are up, or Ended by the game
+    enum class State : std::uint8_t { Running, Waiting, Done, Ended };
+
+    // lanes running the same instruction, lanes[i] for i < count or just i when all of them run
+    struct Group {
+        const std::uint32_t* lanes;
+        std::size_t count;
+        bool all;
+    };
+
+    // Run f on every lane of the group, over the arrays in order when all of them run
+    // Lanes are std::size_t so the compiler can tell the elements of a loop are consecutive
+    template <typename F> static void Each(const Group& group, F f) {
+        const auto count = group.count;
+        if (group.all) {
+            for (std::size_t lane = 0; lane < count; lane++)
+                f(lane);
+        } else {
+            for (std::size_t i = 0; i < count; i++)
+                f(group.lanes[i]);
+        }
+    }
+
+    void Reset(const std::vector<std::uint32_t>& seeds);
+    // Run opcode on the group, all at the same address
+    void Execute(std::uint16_t opcode, const Group& group);
+    // What the timer thread would do every 60 Hz tick, for one lane
+    void Tick(std::size_t lane);
+    // Wait for a key press, store the value of the key in V[x], or park the lane until one comes
+    void LD_Vx_K(std::size_t lane, std::uint8_t x);
+    // Hand over the frame to the next tick if it is the first change since the last one
+    void Show(std::size_t lane);
+    void Replay(std::size_t lane);
+
+    inline std::uint16_t Fetch(std::size_t lane, std::size_t address) const {
+        return memory[lane][address] << 8 | memory[lane][(address + 1) & 0xFFF];
+    }
+
+    const std::vector<std::uint8_t> game;
+    const std::uint64_t instructions_per_tick;
+
+    // the Run going on
+    std::uint64_t ticks = 0;
+    const std::vector<std::vector<Chip8::KeyEvent>>* input = nullptr;
+    const FrameCallback* on_frame = nullptr;
+
+    std::size_t lanes = 0;
+    std::vector<State> state;
+    // one array per register, indexed by lane
+    std::array<std::vector<std::uint8_t>, 16> V;
+    std::vector<std::uint32_t> I;
+    std::vector<std::uint32_t> program_counter;
+    std::array<std::vector<std::uint16_t>, STACK_SIZE> stack;
+    std::vector<std::uint8_t> stack_ptr;
+    std::vector<std::uint8_t> delay_timer;
+    std::vector<std::uint8_t> sound_timer;
+    // bit n is set while key n is held down
+    std::vector<std::uint16_t> keypad_state;
+    // one array per row, so drawing at the same row on every lane is a loop over lanes
+    std::array<std::vector<std::uint64_t>, 32> frame_buffer;
+    // sprite pixels DRW hit on each lane
+    std::vector<std::uint64_t> collision;
+    // the rows of the sprite DRW draws on each lane, rotated to where they go, row * lanes + lane
+    std::vector<std::uint64_t> sprite_rows;
+    // the same rows at the frame rows they go to, for lanes drawing at different rows, empty
+    // between DRWs
+    std::vector<std::uint64_t> placed_rows;
+    // a whole memory per lane, they only share the game until they write into it
+    std::vector<std::array<std::uint8_t, 0x1000>> memory;
+    // memory every lane starts with and the addresses any of them wrote to since, where lanes
+    // can find different code
+    std::array<std::uint8_t, 0x1000> image;
+    std::array<bool, 0x1000> written;
+
+    // the frame handed to the next tick and whether the lane drew since the last one
+    std::vector<Chip8::Frame> shown;
+    std::vector<std::uint8_t> send_frame;
+    // instructions counted towards the next tick and the ones before them
+    std::vector<std::uint64_t> cycles;
+    std::vector<std::uint64_t> instructions;
+    std::vector<std::uint64_t> ticks_run;
+    // the next key event to replay
+    std::vector<std::size_t> next_input;
+    // the same generator and distribution per lane as the Interpreter
+    std::vector<std::mt19937> rng;
+    std::uniform_int_distribution<std::mt19937::result_type> dist =
+        std::uniform_int_distribution<std::mt19937::result_type>(0x00, 0xFF);
+
+    // the lanes at each address for the current step, linked through next_lane
+    std::array<std::uint32_t, 0x1000> first_lane;
+    std::vector<std::uint32_t> next_lane;
+    std::vector<std::uint16_t> addresses;
+    std::vector<std::uint32_t> group_lanes;
+
+    // instructions run by groups and on lanes, for GetLanesPerGroup
+    std::uint64_t groups = 0;
+    std::uint64_t lane_steps = 0;
+};
@@ -3,11 +3,14 @@
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <thread>
+#include <utility>
 #include <vector>
 
 class Chip8 {
@@ -15,9 +18,52 @@ public:
     using Frame = std::array<std::uint64_t, 32>;
     struct Interface;
 
+    // machine state handed from one CPU backend to another, mirrored in aot_ops.hpp
+    struct Snapshot {
+        std::array<std::uint8_t, 0x1000> memory;
+        Frame frame_buffer;
+        std::array<std::uint8_t, 16> V;
+        // addresses of the CALL instructions waiting to be returned to
+        std::array<std::uint32_t, 16> stack;
+        std::uint32_t stack_ptr;
+        std::uint32_t I;
+        std::uint32_t program_counter;
+    };
+
+    // a named counter a backend keeps about how it runs the game
+    struct Stat {
+        const char* name;
+        std::uint64_t value;
+    };
+
     class CPU {
         friend Chip8;
         virtual void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) = 0;
+        // Machine state the last Run stopped at, for backends that can hand it over
+        virtual std::optional<Snapshot> Save() const {
+            return std::nullopt;
+        }
+        // Continue a game from a snapshot of it, or start it over where the backend can't
+        virtual void Resume(Chip8::Interface& interface, std::vector<std::uint8_t> game,
+                            [[maybe_unused]] const Snapshot& snapshot) {
+            Run(interface, std::move(game));
+        }
+        // Steppable backends keep the game in the CPU object between Continue calls instead of
+        // holding on to the thread running it, so many games can share a few threads
+        // Load the game without running it, false if the backend can only Run
+        virtual bool Load([[maybe_unused]] Chip8::Interface& interface,
+                          [[maybe_unused]] std::vector<std::uint8_t> game) {
+            return false;
+        }
+        // Run the loaded game on the calling thread until the interface gets stopped, then
+        // suspend it at a safe point, false once the game ended
+        virtual bool Continue() {
+            return false;
+        }
+        // Counters of the backend since the game was started, callable from any thread
+        virtual std::vector<Stat> GetStats() const {
+            return {};
+        }
 
     public:
         virtual ~CPU() = default;
@@ -25,71 +71,403 @@ public:
 
     struct Interface {
         Frame frame_buffer{};
-        std::array<std::atomic_bool, 16> keypad_state;
-        std::atomic_uint64_t cycle_count;
+        // bit n is set while key n is held down
+        std::atomic_uint32_t keypad_state = 0;
+        // instructions run so far, CPUs count them on their own thread and only add them here
+        // every instruction_budget instructions, before waiting and when they stop
+        std::atomic_uint64_t cycle_count = 0;
         std::atomic_uint8_t delay_timer;
         std::atomic_uint8_t sound_timer;
         std::atomic_bool send_frame = true;
         std::atomic_bool stop_flag = false;
+        // bumped whenever delay_timer ticks down, a key changes or the CPU is stopped
+        std::atomic_uint32_t event_count = 0;
+        // parks the calling thread until event_count moves past seen
+        // a function pointer so that generated code can call back into the host
+        void (*wait_for_event)(Interface& interface, std::uint32_t seen) = &WaitForEvent;
+        // parks the calling thread until any key is held down
+        void (*wait_for_key)(Interface& interface) = &WaitForKey;
+        // called by CPUs every instruction_budget instructions, parks a throttled CPU until the
+        // next tick of the timer thread
+        void (*wait_for_tick)(Interface& interface) = &WaitForTick;
+        // instructions CPUs run before publishing them to cycle_count and calling wait_for_tick,
+        // only changed by Throttle before the CPU starts
+        std::uint64_t instruction_budget = PUBLISH_INTERVAL;
+        // RND seed for reproducible runs, CPUs pick their own when unset
+        std::optional<std::uint32_t> seed;
+        // whether the CPU got stopped in a wait on the timers or keys before what it waits on
+        // happened, only kept up in virtual time
+        bool waiting = false;
+        // set while a CPU is asked to reach a safe point without stopping the game, so a wait on a
+        // key, which only ends on a key or a stop otherwise, lets it get there
+        std::atomic_bool switching = false;
+
+        // often enough for the frontend to show instructions per second, rare enough that the
+        // cache line of cycle_count stays out of the way of the CPU thread
+        static constexpr std::uint64_t PUBLISH_INTERVAL = 0x10000;
+
+        // Run at most instructions_per_tick instructions every 60 Hz tick, 0 runs unthrottled
+        void Throttle(std::uint64_t instructions_per_tick) {
+            throttled = instructions_per_tick != 0;
+            instruction_budget = throttled ? instructions_per_tick : PUBLISH_INTERVAL;
+        }
 
         void PushFrameBuffer(const Frame& frame) {
             frame_buffer = frame;
             send_frame = false;
         }
+
+        void NotifyEvent() {
+            {
+                std::lock_guard lock{event_mutex};
+                event_count++;
+            }
+            event_cv.notify_all();
+            key_cv.notify_all();
+        }
+
+        void SetKey(std::size_t key, bool val) {
+            {
+                std::lock_guard lock{event_mutex};
+                if (val)
+                    keypad_state |= 1u << key;
+                else
+                    keypad_state &= ~(1u << key);
+                event_count++;
+            }
+            event_cv.notify_all();
+            key_cv.notify_all();
+        }
+
+        void Stop() {
+            stop_flag = true;
+            NotifyEvent();
+            key_cv.notify_all();
+        }
+
+        // Tick from the CPU thread every instructions_per_tick instructions instead of from a timer
+        // thread, tick does what the timer thread would. Waits on the timers or keys run ticks
+        // until whatever they wait on happens, so idle games skip ahead instead of sleeping
+        void UseVirtualTime(std::uint64_t instructions_per_tick, std::function<void()> tick) {
+            instruction_budget = instructions_per_tick;
+            virtual_tick = std::move(tick);
+            wait_for_tick = [](Interface& interface) { interface.virtual_tick(); };
+            wait_for_event = [](Interface& interface, std::uint32_t seen) {
+                while (interface.event_count == seen && !interface.stop_flag)
+                    interface.virtual_tick();
+                interface.waiting = interface.event_count == seen;
+            };
+            wait_for_key = [](Interface& interface) {
+                while (interface.keypad_state == 0 && !interface.stop_flag)
+                    interface.virtual_tick();
+                interface.waiting = interface.keypad_state == 0;
+            };
+        }
+
+        // called by the timer thread every 60 Hz tick
+        void Tick() {
+            {
+                std::lock_guard lock{event_mutex};
+                tick_count++;
+            }
+            event_cv.notify_all();
+        }
+
+    private:
+        std::mutex event_mutex;
+        std::condition_variable event_cv;
+        // only woken by key changes so waiting on a key doesn't wake up on every timer tick
+        std::condition_variable key_cv;
+        bool throttled = false;
+        // ticks so far and the one the instruction budget of the CPU was handed out in, both
+        // guarded by event_mutex
+        std::uint32_t tick_count = 0;
+        std::uint32_t budget_tick = 0;
+        std::function<void()> virtual_tick;
+
+        static void WaitForEvent(Interface& interface, std::uint32_t seen) {
+            std::unique_lock lock{interface.event_mutex};
+            interface.event_cv.wait(
+                lock, [&] { return interface.event_count != seen || interface.stop_flag; });
+        }
+
+        static void WaitForKey(Interface& interface) {
+            std::unique_lock lock{interface.event_mutex};
+            interface.key_cv.wait(
+                lock, [&] {
+                    return interface.keypad_state != 0 || interface.stop_flag ||
+                           interface.switching;
+                });
+        }
+
+        // a CPU that fell behind the ticks gets its next budget right away
+        static void WaitForTick(Interface& interface) {
+            if (!interface.throttled)
+                return;
+            std::unique_lock lock{interface.event_mutex};
+            interface.event_cv.wait(lock, [&] {
+                return interface.tick_count != interface.budget_tick || interface.stop_flag;
+            });
+            interface.budget_tick = interface.tick_count;
+        }
     };
 
 private:
     std::unique_ptr<Interface> interface;
     std::unique_ptr<CPU> cpu;
     std::optional<std::thread> cpu_thread, timer_thread;
+    // the game as it was loaded, runtime writes into memory aside
+    std::vector<std::uint8_t> loaded;
+    std::uint64_t instructions_per_tick = 0;
+    // virtual ticks since Load and the one the current RunFor ends at
+    std::uint64_t virtual_ticks = 0, slice_end = 0;
+    bool tick_due = false;
+    // whether the game was loaded for RunFor and has run yet
+    bool stepping = false, started = false;
+    // keys set since the last tick of a stepped game
+    std::vector<std::pair<std::size_t, bool>> pending_keys;
+    const std::function<void(std::uint64_t tick, const Frame& frame)>* slice_frames = nullptr;
+    // how late the timer thread woke up for its ticks, written by it and reset by GetTickDrift
+    std::atomic_uint64_t drift_ticks = 0, drift_total = 0, drift_max = 0;
 
     // returns true if sound_timer hits 0
     bool DecrementTimers() {
-        if (interface->delay_timer)
+        if (interface->delay_timer) {
             interface->delay_timer--;
+            interface->NotifyEvent();
+        }
         std::uint8_t st = interface->sound_timer;
         if (st != 0)
             interface->sound_timer--;
         return st == 1;
     }
 
-public:
-    Chip8(std::unique_ptr<CPU> cpu) : cpu{std::move(cpu)} {}
-
-    void Run(std::vector<std::uint8_t> game) {
-        Stop();
-        interface = std::make_unique<Interface>();
-        assert(interface);
+    // Start the timer thread and run cpu_job on the CPU thread
+    void Start(std::function<void()> cpu_job) {
         timer_thread = std::thread([this] {
+            using Clock = std::chrono::steady_clock;
+            const auto period = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(1. / 60.));
+            // sleeping until absolute deadlines keeps late wakeups from adding up
+            auto deadline = Clock::now();
             for (;;) {
                 DecrementTimers();
+                interface->Tick();
                 if (interface->stop_flag)
                     return;
-                std::this_thread::sleep_for(std::chrono::duration<double>(1. / 60.));
+                deadline += period;
+                std::this_thread::sleep_until(deadline);
+                const auto late = Clock::now() - deadline;
+                const auto nanoseconds = static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(late).count());
+                drift_ticks++;
+                drift_total += nanoseconds;
+                if (nanoseconds > drift_max)
+                    drift_max = nanoseconds;
+                // after a stall, like the host suspending, skip the missed ticks instead of
+                // running them back to back
+                if (late > period)
+                    deadline = Clock::now();
             }
         });
-        cpu_thread =
-            std::thread([this, game = std::move(game)] { cpu->Run(*interface, std::move(game)); });
+        cpu_thread = std::thread(std::move(cpu_job));
     }
 
-    void Stop() {
-        if (interface)
-            interface->stop_flag = true;
+    void Join() {
         if (cpu_thread)
             cpu_thread->join();
         if (timer_thread)
             timer_thread->join();
         cpu_thread.reset();
         timer_thread.reset();
+    }
+
+public:
+    Chip8(std::unique_ptr<CPU> cpu) : cpu{std::move(cpu)} {}
+
+    void Run(std::vector<std::uint8_t> game) {
+        Stop();
+        interface = std::make_unique<Interface>();
+        assert(interface);
+        interface->Throttle(instructions_per_tick);
+        loaded = game;
+        Start([this, game = std::move(game)] { cpu->Run(*interface, std::move(game)); });
+    }
+
+    // Swap the running game for an edited version of it once the CPU reaches a safe point
+    // Bytes the edit changed are written over memory, everything else the game did so far stays
+    // if the CPU can continue from there
+    void Reload(std::vector<std::uint8_t> game) {
+        if (!interface)
+            return Run(std::move(game));
+        interface->Stop();
+        Join();
+        auto snapshot = cpu->Save();
+        interface->stop_flag = false;
+        if (!snapshot) {
+            loaded = game;
+            Start([this, game = std::move(game)] { cpu->Run(*interface, std::move(game)); });
+            return;
+        }
+
+        for (std::size_t i = 0; i < snapshot->memory.size() - 0x200; i++) {
+            const std::uint8_t before = i < loaded.size() ? loaded[i] : 0;
+            const std::uint8_t after = i < game.size() ? game[i] : 0;
+            if (before != after)
+                snapshot->memory[0x200 + i] = after;
+        }
+        loaded = game;
+        Start([this, game = std::move(game), snapshot = *snapshot] {
+            cpu->Resume(*interface, std::move(game), snapshot);
+        });
+    }
+
+    void Stop() {
+        if (interface)
+            interface->Stop();
+        Join();
         interface.reset();
+        stepping = started = false;
+        pending_keys.clear();
+    }
+
+    // a key going down or up at the start of a tick, for RunVirtual to replay
+    struct KeyEvent {
+        std::uint64_t tick;
+        std::size_t key;
+        bool down;
+    };
+
+    // Run the game on the calling thread in virtual time, with the CPU ticking the timers every
+    // instructions_per_tick instructions instead of a timer thread, until ticks ticks went by or
+    // the game leaves memory
+    // Replays input, sorted by tick, and hands the frame of every tick to on_frame. The same
+    // game, input, seed and CPU always give the same frames, as fast as the CPU runs them, except
+    // for Tiered, which switches tiers whenever its compiler thread is done
+    void RunVirtual(std::vector<std::uint8_t> game, std::uint64_t instructions_per_tick,
+                    std::uint64_t ticks, const std::vector<KeyEvent>& input, std::uint32_t seed,
+                    const std::function<void(std::uint64_t tick, const Frame& frame)>& on_frame) {
+        Stop();
+        interface = std::make_unique<Interface>();
+        interface->seed = seed;
+        loaded = game;
+        std::uint64_t tick = 0;
+        auto next = input.begin();
+        const auto replay = [&] {
+            for (; next != input.end() && next->tick <= tick; ++next)
+                interface->SetKey(next->key, next->down);
+        };
+        replay();
+        interface->UseVirtualTime(instructions_per_tick, [&] {
+            // CPUs can run into a few more ticks before they notice the stop
+            if (tick == ticks)
+                return;
+            tick++;
+            DecrementTimers();
+            replay();
+            on_frame(tick, interface->frame_buffer);
+            interface->send_frame = true;
+            if (tick == ticks)
+                interface->Stop();
+        });
+        if (ticks == 0)
+            interface->Stop();
+        cpu->Run(*interface, std::move(game));
+    }
+
+    // Load the game to run a slice at a time with RunFor, in virtual time like RunVirtual but
+    // without any threads, false if the CPU can't be stepped
+    bool Load(std::vector<std::uint8_t> game, std::uint64_t instructions_per_tick,
+              std::uint32_t seed) {
+        Stop();
+        interface = std::make_unique<Interface>();
+        interface->seed = seed;
+        loaded = game;
+        virtual_ticks = slice_end = 0;
+        tick_due = false;
+        interface->UseVirtualTime(instructions_per_tick, [this] {
+            // a CPU that used up its budget after the slice ended gets the tick at the start of
+            // the next one, as if it had never been suspended
+            if (virtual_ticks == slice_end) {
+                tick_due = true;
+                return;
+            }
+            virtual_ticks++;
+            DecrementTimers();
+            for (auto [key, val] : pending_keys)
+                interface->SetKey(key, val);
+            pending_keys.clear();
+            (*slice_frames)(virtual_ticks, interface->frame_buffer);
+            interface->send_frame = true;
+            // only the flag, a stop would count as an event and wake up timer polls
+            if (virtual_ticks == slice_end)
+                interface->stop_flag = true;
+        });
+        stepping = cpu->Load(*interface, std::move(game));
+        return stepping;
+    }
+
+    // Run the loaded game on the calling thread for ticks more ticks, handing the frame of each
+    // to on_frame, and return with the game suspended, false once the game ended
+    // Keys set before the first slice are down from the start, later ones from the next tick on,
+    // so the same keys between the same slices always give the same frames
+    bool RunFor(std::uint64_t ticks,
+                const std::function<void(std::uint64_t tick, const Frame& frame)>& on_frame) {
+        if (!stepping || ticks == 0)
+            return stepping;
+        slice_end = virtual_ticks + ticks;
+        slice_frames = &on_frame;
+        started = true;
+        interface->stop_flag = false;
+        interface->waiting = false;
+        if (std::exchange(tick_due, false))
+            interface->wait_for_tick(*interface);
+        return cpu->Continue();
     }
 
+    // backend specific counters, up to date as of the last time the CPU added to GetCycles
+    std::vector<Stat> GetCPUStats() const {
+        return cpu->GetStats();
+    }
+
+    // instructions run since the last call
     std::uint64_t GetCycles() {
-        return interface->cycle_count.exchange(0) / 2;
+        return interface->cycle_count.exchange(0);
+    }
+
+    // whether the stepped game ended its last slice in a wait with both timers out, which only
+    // a key can end
+    bool WaitsForKey() const {
+        return interface->waiting && interface->delay_timer == 0 && interface->sound_timer == 0;
+    }
+
+    // Run at most instructions_per_tick instructions every 60 Hz tick from the next game on, 0
+    // runs unthrottled
+    void Throttle(std::uint64_t instructions_per_tick) {
+        this->instructions_per_tick = instructions_per_tick;
+    }
+
+    struct TickDrift {
+        std::uint64_t ticks;
+        // how late the timer thread woke up for them
+        std::chrono::nanoseconds mean, max;
+    };
+    // ticks since the last call and how far they drifted from their deadlines
+    TickDrift GetTickDrift() {
+        const auto ticks = drift_ticks.exchange(0);
+        const auto total = drift_total.exchange(0);
+        const auto max = drift_max.exchange(0);
+        return {ticks, std::chrono::nanoseconds(ticks ? total / ticks : 0),
+                std::chrono::nanoseconds(max)};
     }
 
     void SetKey(std::size_t key, bool val) {
-        interface->keypad_state[key] = val;
+        // a stepped game gets it at its next tick, however far the CPU ran past the last one
+        if (stepping && started) {
+            pending_keys.emplace_back(key, val);
+            return;
+        }
+        interface->SetKey(key, val);
     }
 
     void ConsumeFrameBuffer(std::function<void(const Frame&)> callback) {
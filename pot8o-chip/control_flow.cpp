@@ -0,0 +1,268 @@
+#include <algorithm>
+
+#include "control_flow.hpp"
+
+static bool IsSkip(std::uint16_t opcode) {
+    switch (opcode >> 12) {
+    case 0x3:
+    case 0x4:
+    case 0x5:
+    case 0x9:
+        return true;
+    case 0xE:
+        return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+    default:
+        return false;
+    }
+}
+
+// whether the code after the instruction might not run right after it
+static bool EndsBlock(std::uint16_t opcode) {
+    switch (opcode >> 12) {
+    case 0x0:
+        return opcode == 0x00EE;
+    case 0x1:
+    case 0x2:
+    case 0xB:
+        return true;
+    case 0xF:
+        return (opcode & 0xFF) == 0x33 || (opcode & 0xFF) == 0x55;
+    default:
+        return IsSkip(opcode);
+    }
+}
+
+ControlFlow::ControlFlow(std::vector<std::uint8_t> game, const std::vector<std::size_t>& entries)
+    : game{std::move(game)} {
+    while (Explore(entries)) {
+    }
+}
+
+bool ControlFlow::Explore(const std::vector<std::size_t>& entries) {
+    functions.clear();
+    reachable = {};
+    instructions.clear();
+    std::vector<std::size_t> pending{entries.rbegin(), entries.rend()};
+    while (!pending.empty()) {
+        const auto entry = pending.back();
+        pending.pop_back();
+        if (FunctionAt(entry))
+            continue;
+        functions.push_back(Walk(entry));
+        for (auto callee : functions.back().callees)
+            pending.push_back(callee);
+        for (auto address : functions.back().instructions)
+            reachable[address] = true;
+    }
+    for (std::size_t address = 0; address < reachable.size(); address++)
+        if (reachable[address])
+            instructions.push_back(address);
+
+    // the narrowed JP V0 targets only hold if control can't get between the JP and what set V0
+    // other than falling through
+    std::array<bool, 0x1000> targeted{};
+    const auto target = [&](std::size_t address) {
+        if (address < targeted.size())
+            targeted[address] = true;
+    };
+    for (auto entry : entries)
+        target(entry);
+    for (auto address : instructions) {
+        const auto opcode = Opcode(address);
+        if (opcode >> 12 == 0x1 || opcode >> 12 == 0x2) {
+            target(opcode & 0x0FFF);
+        } else if (opcode >> 12 == 0xB) {
+            for (auto jump : JumpV0Targets(address))
+                target(jump);
+        } else if (IsSkip(opcode)) {
+            target(address + 4);
+        }
+    }
+    bool changed = false;
+    for (auto address : instructions) {
+        if (Opcode(address) >> 12 != 0xB || v0_unknown[address])
+            continue;
+        for (auto after = FindV0(address).set_at + 2; after <= address; after += 2)
+            if (targeted[after]) {
+                v0_unknown[address] = true;
+                changed = true;
+                break;
+            }
+    }
+    return changed;
+}
+
+ControlFlow::V0Values ControlFlow::FindV0(std::size_t address) const {
+    V0Values found{{}, address};
+    found.values.set();
+    if (v0_unknown[address])
+        return found;
+    // a few instructions back through code that falls through, stopping at the first write to V0
+    for (std::size_t steps = 0, at = address; steps < 8 && at >= EXECUTION_OFFSET + 2; steps++) {
+        at -= 2;
+        const auto opcode = Opcode(at);
+        if (EndsBlock(opcode))
+            return found;
+        const std::uint8_t x = (opcode & 0x0F00) >> 8;
+        const std::uint8_t kk = opcode & 0x00FF;
+        const bool writes_v0 =
+            (x == 0 && (opcode >> 12 == 0x6 || opcode >> 12 == 0x7 || opcode >> 12 == 0x8 ||
+                        opcode >> 12 == 0xC || opcode == 0xF007 || opcode == 0xF00A)) ||
+            (opcode >> 12 == 0xF && kk == 0x65);
+        if (!writes_v0)
+            continue;
+
+        found.values.reset();
+        if (opcode >> 12 == 0x6) {
+            // LD V0, kk
+            found.values.set(kk);
+        } else if (opcode >> 12 == 0xC) {
+            // RND V0, kk gives every value masked by kk
+            for (std::size_t value = 0; value < found.values.size(); value++)
+                found.values[value] = (value & ~kk) == 0;
+        } else if ((opcode & 0xF00F) == 0x800E) {
+            // SHL V0 leaves it even
+            for (std::size_t value = 0; value < found.values.size(); value += 2)
+                found.values.set(value);
+        } else if ((opcode & 0xF00F) == 0x8006) {
+            // SHR V0 leaves it below 0x80
+            for (std::size_t value = 0; value < 0x80; value++)
+                found.values.set(value);
+        } else {
+            found.values.set();
+            return found;
+        }
+        found.set_at = at;
+        return found;
+    }
+    return found;
+}
+
+ControlFlow::Function ControlFlow::Walk(std::size_t entry) const {
+    Function function{entry, {}, {}};
+    std::vector<std::size_t> pending{entry};
+    while (!pending.empty()) {
+        const auto address = pending.back();
+        pending.pop_back();
+        // an instruction needs both of its bytes inside the game
+        if (!InGame(address) || !InGame(address + 1) || function.reachable[address])
+            continue;
+        function.reachable[address] = true;
+        function.instructions.push_back(address);
+        if (Opcode(address) >> 12 == 0x2)
+            function.callees.push_back(Opcode(address) & 0x0FFF);
+        for (auto successor : Successors(address))
+            pending.push_back(successor);
+    }
+    std::sort(function.instructions.begin(), function.instructions.end());
+    return function;
+}
+
+const ControlFlow::Function* ControlFlow::FunctionAt(std::size_t entry) const {
+    for (const auto& function : functions)
+        if (function.entry == entry)
+            return &function;
+    return nullptr;
+}
+
+std::uint16_t ControlFlow::Opcode(std::size_t address) const {
+    const auto offset = address - EXECUTION_OFFSET;
+    if (address < EXECUTION_OFFSET || offset + 1 >= game.size())
+        return 0;
+    return game[offset] << 8 | game[offset + 1];
+}
+
+std::vector<std::size_t> ControlFlow::JumpV0Targets(std::size_t address) const {
+    const std::size_t nnn = Opcode(address) & 0x0FFF;
+    const auto values = FindV0(address).values;
+    std::vector<std::size_t> targets;
+    for (std::size_t value = 0; value < values.size(); value++)
+        if (values[value] && InGame(nnn + value))
+            targets.push_back(nnn + value);
+    return targets;
+}
+
+std::vector<std::size_t> ControlFlow::Successors(std::size_t address) const {
+    const auto opcode = Opcode(address);
+    const std::size_t nnn = opcode & 0x0FFF;
+    const auto next = address + 2, skip = address + 4;
+    switch (opcode >> 12) {
+    case 0x0:
+        // RET continues after a CALL, which already counts that address as reachable
+        if (opcode == 0x00EE)
+            return {};
+        return {next};
+    case 0x1:
+        // jumping to itself ends the game
+        if (nnn == address)
+            return {};
+        return {nnn};
+    case 0x2:
+        // the subroutine is a function of its own
+        return {next};
+    case 0x3:
+    case 0x4:
+    case 0x5:
+    case 0x9:
+        return {next, skip};
+    case 0xB:
+        return JumpV0Targets(address);
+    case 0xE:
+        if ((opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1)
+            return {next, skip};
+        return {next};
+    default:
+        return {next};
+    }
+}
+
+std::vector<std::size_t>
+ControlFlow::BlockLengths(const std::vector<std::size_t>& addresses,
+                          const std::function<std::uint16_t(std::size_t)>& opcode,
+                          const std::vector<std::size_t>& entries,
+                          const std::function<std::vector<std::size_t>(std::size_t)>&
+                              jump_v0_targets) {
+    std::array<bool, 0x1000> present{}, leader{};
+    for (auto address : addresses)
+        present[address] = true;
+    const auto mark = [&](std::size_t address) {
+        if (address < leader.size())
+            leader[address] = true;
+    };
+    for (auto address : addresses) {
+        if (address < 2 || !present[address - 2] || EndsBlock(opcode(address - 2)))
+            leader[address] = true;
+        const auto instruction = opcode(address);
+        const std::size_t nnn = instruction & 0x0FFF;
+        if (instruction >> 12 == 0x1 || instruction >> 12 == 0x2) {
+            mark(nnn);
+        } else if (instruction >> 12 == 0xB && jump_v0_targets) {
+            for (auto target : jump_v0_targets(address))
+                mark(target);
+        } else if (instruction >> 12 == 0xB) {
+            for (auto target = nnn; target <= nnn + 0xFF; target++)
+                mark(target);
+        } else if (IsSkip(instruction)) {
+            // the instruction after the skip already starts a block
+            mark(address + 4);
+        }
+    }
+    for (auto entry : entries)
+        mark(entry);
+
+    // instructions at odd and even addresses can overlap, so blocks are followed by address
+    // instead of through addresses
+    std::vector<std::size_t> lengths(addresses.size());
+    for (std::size_t i = 0; i < addresses.size(); i++) {
+        if (!leader[addresses[i]])
+            continue;
+        for (auto address = addresses[i];; address += 2) {
+            lengths[i]++;
+            const auto next = address + 2;
+            if (EndsBlock(opcode(address)) || next >= present.size() || !present[next] ||
+                leader[next])
+                break;
+        }
+    }
+    return lengths;
+}
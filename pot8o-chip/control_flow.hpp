@@ -0,0 +1,98 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Static disassembly of a game, finds every instruction reachable from 0x200 by following
+// fallthrough, jumps, calls and skips so that sprite data never gets compiled as code
+class ControlFlow {
+public:
+    // entries past the first are code only found at runtime, like JP V0 targets
+    explicit ControlFlow(std::vector<std::uint8_t> game,
+                         const std::vector<std::size_t>& entries = {EXECUTION_OFFSET});
+
+    // code reachable from an entry point without following CALLs into their subroutines
+    struct Function {
+        std::size_t entry;
+        // reachable instructions in address order
+        std::vector<std::size_t> instructions;
+        // entries of the subroutines CALLs in this function go to
+        std::vector<std::size_t> callees;
+
+        bool Contains(std::size_t address) const {
+            return address < reachable.size() && reachable[address];
+        }
+
+        std::array<bool, 0x1000> reachable{};
+    };
+
+    // whether a reachable instruction starts at address, which may be odd
+    bool IsInstruction(std::size_t address) const {
+        return address < reachable.size() && reachable[address];
+    }
+    // reachable instructions in address order
+    const std::vector<std::size_t>& Instructions() const {
+        return instructions;
+    }
+    // the code at 0x200 first, then every subroutine it calls into
+    const std::vector<Function>& Functions() const {
+        return functions;
+    }
+    // function starting at entry, nullptr if nothing calls it
+    const Function* FunctionAt(std::size_t entry) const;
+    // opcode at address in the game, 0 past its end
+    std::uint16_t Opcode(std::size_t address) const;
+    // JP V0, nnn can land anywhere in nnn + 0x00 to nnn + 0xFF, returns the targets inside the game
+    // Narrowed down to the values V0 can have when the straight-line code before the JP sets it
+    // and nothing jumps in between
+    std::vector<std::size_t> JumpV0Targets(std::size_t address) const;
+    const std::vector<std::uint8_t>& Game() const {
+        return game;
+    }
+
+    // Instructions in the basic block starting at each of addresses, 0 for the ones inside a block
+    // addresses have to be in address order, opcode reads the instruction at an address
+    // Blocks start at jump and skip targets and wherever control can't fall in from the
+    // instruction before, they end at branches and at stores that could overwrite the code after
+    // them, so generated code only has to count instructions once per block
+    // entries start a block too, for code entered where the disassembly doesn't see a jump
+    // jump_v0_targets gives the targets of a JP V0 like JumpV0Targets, all 256 without it
+    static std::vector<std::size_t>
+    BlockLengths(const std::vector<std::size_t>& addresses,
+                 const std::function<std::uint16_t(std::size_t)>& opcode,
+                 const std::vector<std::size_t>& entries = {},
+                 const std::function<std::vector<std::size_t>(std::size_t)>& jump_v0_targets =
+                     nullptr);
+
+private:
+    // what the straight-line code before a JP V0 leaves in V0
+    struct V0Values {
+        // bit v is set if V0 can be v at the JP
+        std::bitset<0x100> values;
+        // the instruction that set V0, the JP itself if none did
+        std::size_t set_at;
+    };
+
+    // Find the functions reachable from entries, true if a JP V0 turned out to be jumped into past
+    // what sets its V0 and has to be explored again with all of its targets
+    bool Explore(const std::vector<std::size_t>& entries);
+    V0Values FindV0(std::size_t address) const;
+    Function Walk(std::size_t entry) const;
+    // addresses control can move to after the instruction at address in the same function, RET
+    // excluded and CALL continuing after itself
+    std::vector<std::size_t> Successors(std::size_t address) const;
+    bool InGame(std::size_t address) const {
+        return address >= EXECUTION_OFFSET && address < EXECUTION_OFFSET + game.size();
+    }
+
+    static constexpr std::size_t EXECUTION_OFFSET = 0x200;
+
+    std::vector<std::uint8_t> game;
+    std::array<bool, 0x1000> reachable{};
+    std::vector<std::size_t> instructions;
+    std::vector<Function> functions;
+    // JP V0s that something jumps into past the instruction setting V0, they can go anywhere
+    std::array<bool, 0x1000> v0_unknown{};
+};
@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+
+#include <fmt/format.h>
+
+#include "copy_patch.hpp"
+#include "font.hpp"
+
+#if defined(POT8O_STENCILS)
+#include <sys/mman.h>
+
+#include "control_flow.hpp"
+#include "game_image.hpp"
+
+namespace {
+using Hole = CopyPatch::Hole;
+using Patch = CopyPatch::Patch;
+using Relocation = CopyPatch::Relocation;
+using Stencil = CopyPatch::Stencil;
+#include "stencils.inc"
+
+// opcode at address, 0 past the end of memory like everywhere else
+std::uint16_t Opcode(const std::array<std::uint8_t, 0x1000>& memory, std::size_t address) {
+    return address + 1 < memory.size() ? memory[address] << 8 | memory[address + 1] : 0;
+}
+
+// movabs rax, imm64; jmp rax, for the library functions stencils call, which may be further
+// than a rel32 away
+constexpr std::size_t VENEER_SIZE = 12;
+
+void WriteVeneer(std::uint8_t* at, const void* function) {
+    const auto address = reinterpret_cast<std::uint64_t>(function);
+    at[0] = 0x48;
+    at[1] = 0xB8;
+    std::memcpy(at + 2, &address, sizeof(address));
+    at[10] = 0xFF;
+    at[11] = 0xE0;
+}
+
+void Apply(std::uint8_t* at, Relocation relocation, std::uint64_t value) {
+    switch (relocation) {
+    case Relocation::ABS8:
+        *at = static_cast<std::uint8_t>(value);
+        break;
+    case Relocation::ABS16: {
+        const auto narrow = static_cast<std::uint16_t>(value);
+        std::memcpy(at, &narrow, sizeof(narrow));
+        break;
+    }
+    case Relocation::ABS32: {
+        const auto narrow = static_cast<std::uint32_t>(value);
+        std::memcpy(at, &narrow, sizeof(narrow));
+        break;
+    }
+    case Relocation::ABS64:
+        std::memcpy(at, &value, sizeof(value));
+        break;
+    case Relocation::PC32: {
+        // everything jumped to is inside the same buffer
+        const auto displacement =
+            static_cast<std::int32_t>(value - reinterpret_cast<std::uint64_t>(at));
+        std::memcpy(at, &displacement, sizeof(displacement));
+        break;
+    }
+    }
+}
+} // namespace
+#endif
+
+CopyPatch::CopyPatch() = default;
+
+CopyPatch::~CopyPatch() {
+    Release();
+}
+
+void CopyPatch::Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+#if !defined(POT8O_STENCILS)
+    fmt::print("copy-and-patch stencils need clang on x86-64 Linux, running the interpreter\n");
+    fallback.Run(interface, std::move(game));
+#else
+    Release();
+    state = {};
+    auto& machine = state.machine;
+    std::copy(FONT.begin(), FONT.end(), machine.memory.begin());
+    std::copy_n(game.begin(), std::min<std::size_t>(game.size(), 0x1000 - 0x200),
+                machine.memory.begin() + 0x200);
+    machine.program_counter = 0x200;
+    state.rand = GameSeed(interface);
+    entries = {0x200};
+    compiles = 0;
+    std::chrono::duration<double, std::micro> compile_time{};
+
+    while (machine.program_counter < 0x1000 &&
+           !interface.stop_flag.load(std::memory_order_relaxed)) {
+        const auto address = machine.program_counter;
+        if (state.invalidated || !state.code[address]) {
+            // a store can rewrite the instruction before the address, which then has to start a
+            // block of its own
+            if (std::find(entries.begin(), entries.end(), address) == entries.end())
+                entries.push_back(address);
+            const auto start = std::chrono::steady_clock::now();
+            Compile();
+            compile_time += std::chrono::steady_clock::now() - start;
+            if (!state.code[address])
+                break;
+        }
+        state.code[address](&interface, &state);
+    }
+    interface.cycle_count += state.cycles;
+
+    fmt::print("compiled {} times in {:.1f} us\n", compiles, compile_time.count());
+#endif
+}
+
+#if defined(POT8O_STENCILS)
+const CopyPatch::Stencil& CopyPatch::Select(std::size_t address) const {
+    const auto& memory = state.machine.memory;
+    const auto opcode = Opcode(memory, address);
+    const auto x = (opcode & 0x0F00) >> 8, kk = opcode & 0xFF;
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0)
+            return CLS_stencil;
+        if (opcode == 0x00EE)
+            return RET_stencil;
+        return NOOP_stencil;
+    case 0x1:
+        return (opcode & 0x0FFF) == address ? END_stencil : JP_addr_stencil;
+    case 0x2:
+        return CALL_addr_stencil;
+    case 0x3:
+        return SE_Vx_byte_stencil;
+    case 0x4:
+        return SNE_Vx_byte_stencil;
+    case 0x5:
+        return SE_Vx_Vy_stencil;
+    case 0x6:
+        return LD_Vx_byte_stencil;
+    case 0x7:
+        return ADD_Vx_byte_stencil;
+    case 0x8:
+        switch (opcode & 0xF) {
+        case 0x0:
+            return LD_Vx_Vy_stencil;
+        case 0x1:
+            return OR_Vx_Vy_stencil;
+        case 0x2:
+            return AND_Vx_Vy_stencil;
+        case 0x3:
+            return XOR_Vx_Vy_stencil;
+        case 0x4:
+            return ADD_Vx_Vy_stencil;
+        case 0x5:
+            return SUB_Vx_Vy_stencil;
+        case 0x6:
+            return SHR_Vx_stencil;
+        case 0x7:
+            return SUBN_Vx_Vy_stencil;
+        case 0xE:
+            return SHL_Vx_stencil;
+        default:
+            return NOOP_stencil;
+        }
+    case 0x9:
+        return SNE_Vx_Vy_stencil;
+    case 0xA:
+        return LD_I_addr_stencil;
+    case 0xB:
+        return JP_V0_addr_stencil;
+    case 0xC:
+        return RND_Vx_byte_stencil;
+    case 0xD:
+        return DRW_Vx_Vy_nibble_stencil;
+    case 0xE:
+        if (kk == 0x9E)
+            return SKP_Vx_stencil;
+        if (kk == 0xA1)
+            return SKNP_Vx_stencil;
+        return NOOP_stencil;
+    default:
+        switch (kk) {
+        case 0x07: {
+            // LD Vx, DT; SE/SNE Vx, kk; JP back to the LD only waits for the timer thread
+            const auto skip = Opcode(memory, address + 2);
+            if (Opcode(memory, address + 4) == (0x1000 | address) && (skip & 0x0F00) >> 8 == x) {
+                if (skip >> 12 == 0x3)
+                    return LD_Vx_DT_SE_idle_stencil;
+                if (skip >> 12 == 0x4)
+                    return LD_Vx_DT_SNE_idle_stencil;
+            }
+            return LD_Vx_DT_stencil;
+        }
+        case 0x0A:
+            return LD_Vx_K_stencil;
+        case 0x15:
+            return LD_DT_Vx_stencil;
+        case 0x18:
+            return LD_ST_Vx_stencil;
+        case 0x1E:
+            return ADD_I_Vx_stencil;
+        case 0x29:
+            return LD_F_Vx_stencil;
+        case 0x33:
+            return LD_B_Vx_stencil;
+        case 0x55:
+            return LD_I_Vx_stencil;
+        case 0x65:
+            return LD_Vx_I_stencil;
+        default:
+            return NOOP_stencil;
+        }
+    }
+}
+
+void CopyPatch::Compile() {
+    const auto& memory = state.machine.memory;
+    const ControlFlow flow({memory.begin() + 0x200, memory.end()}, entries);
+    // entries the disassembly can't follow, in the font or at 0xFFF, still get their instruction
+    std::array<bool, 0x1000> present{};
+    for (const auto address : flow.Instructions())
+        present[address] = true;
+    for (const auto address : entries)
+        present[address] = true;
+    std::vector<std::size_t> instructions;
+    for (std::size_t address = 0; address < present.size(); address++)
+        if (present[address])
+            instructions.push_back(address);
+    const auto is_instruction = [&](std::size_t address) {
+        return address < present.size() && present[address];
+    };
+    const auto blocks = ControlFlow::BlockLengths(
+        instructions, [&](std::size_t address) { return Opcode(memory, address); }, entries);
+
+    // stencils go in address order so the jump to the next instruction can be dropped whenever it
+    // directly follows, veneers for library calls come first and exits for jumps out of the
+    // compiled code last
+    // offsets point at the COUNT in front of instructions starting a block, bodies at the
+    // instruction itself
+    std::size_t size = 2 * VENEER_SIZE;
+    const auto count_length =
+        COUNT_stencil.falls_through ? COUNT_stencil.size - 5 : COUNT_stencil.size;
+    std::vector<const Stencil*> stencils;
+    std::vector<std::size_t> lengths, bodies;
+    std::array<std::size_t, 0x1000> offsets{};
+    for (std::size_t i = 0; i < instructions.size(); i++) {
+        const auto address = instructions[i];
+        const auto& stencil = Select(address);
+        const auto falls_through = stencil.falls_through && i + 1 < instructions.size() &&
+                                   instructions[i + 1] == address + 2;
+        stencils.push_back(&stencil);
+        lengths.push_back(falls_through ? stencil.size - 5 : stencil.size);
+        offsets[address] = size;
+        if (blocks[i])
+            size += count_length;
+        bodies.push_back(size);
+        size += lengths.back();
+    }
+    std::map<std::size_t, std::size_t> exits;
+    for (const auto address : instructions) {
+        const std::size_t nnn = Opcode(memory, address) & 0x0FFF;
+        for (const auto target : {address + 2, address + 4, nnn})
+            if (!is_instruction(target) && !exits.count(target)) {
+                exits[target] = size;
+                size += EXIT_stencil.size;
+            }
+    }
+
+    const auto code = static_cast<std::uint8_t*>(
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (code == MAP_FAILED) {
+        fmt::print("can't map {} bytes for compiled code\n", size);
+        return;
+    }
+    const auto base = reinterpret_cast<std::uint64_t>(code);
+    WriteVeneer(code, reinterpret_cast<const void*>(&memcpy));
+    WriteVeneer(code + VENEER_SIZE, reinterpret_cast<const void*>(&memset));
+    const auto code_at = [&](std::size_t address) {
+        return base + (is_instruction(address) ? offsets[address] : exits.at(address));
+    };
+
+    // COUNT gets the length of its block and the instruction after it as NEXT
+    const auto copy = [&](const Stencil& stencil, std::size_t length, std::size_t offset,
+                          std::size_t address, std::size_t count = 0, std::uint64_t next = 0) {
+        const auto opcode = Opcode(memory, address);
+        std::memcpy(code + offset, stencil.code, length);
+        for (std::size_t i = 0; i < stencil.patch_count; i++) {
+            const auto& patch = stencil.patches[i];
+            // the dropped jump
+            if (patch.offset >= length)
+                continue;
+            std::uint64_t value = 0;
+            switch (patch.hole) {
+            case Hole::X:
+                value = (opcode & 0x0F00) >> 8;
+                break;
+            case Hole::Y:
+                value = (opcode & 0x00F0) >> 4;
+                break;
+            case Hole::N:
+                value = opcode & 0x000F;
+                break;
+            case Hole::KK:
+                // the idle timer polls compare against kk of the skip after them
+                value = &stencil == &LD_Vx_DT_SE_idle_stencil ||
+                                &stencil == &LD_Vx_DT_SNE_idle_stencil
+                            ? memory[address + 3]
+                            : opcode & 0x00FF;
+                break;
+            case Hole::NNN:
+                value = opcode & 0x0FFF;
+                break;
+            case Hole::PC:
+                value = address;
+                break;
+            case Hole::COUNT:
+                value = count;
+                break;
+            case Hole::NEXT:
+                value = next ? next : code_at(address + 2);
+                break;
+            case Hole::SKIP:
+                value = code_at(address + 4);
+                break;
+            case Hole::JUMP:
+                value = code_at(opcode & 0x0FFF);
+                break;
+            case Hole::MEMCPY:
+                value = base;
+                break;
+            case Hole::MEMSET:
+                value = base + VENEER_SIZE;
+                break;
+            }
+            Apply(code + offset + patch.offset, patch.relocation, value + patch.addend);
+        }
+    };
+    for (std::size_t i = 0; i < instructions.size(); i++) {
+        const auto address = instructions[i];
+        if (blocks[i])
+            copy(COUNT_stencil, count_length, offsets[address], address, blocks[i],
+                 base + bodies[i]);
+        copy(*stencils[i], lengths[i], bodies[i], address);
+    }
+    for (const auto& [address, offset] : exits)
+        copy(EXIT_stencil, EXIT_stencil.size, offset, address);
+    mprotect(code, size, PROT_READ | PROT_EXEC);
+
+    Release();
+    buffer = code;
+    buffer_size = size;
+    state.code.fill(nullptr);
+    state.compiled.fill(false);
+    for (const auto address : instructions) {
+        state.code[address] = reinterpret_cast<Code>(base + offsets[address]);
+        state.compiled[address] = true;
+        state.compiled[(address + 1) & 0xFFF] = true;
+    }
+    state.invalidated = false;
+    compiles++;
+}
+
+void CopyPatch::Release() {
+    if (buffer)
+        munmap(buffer, buffer_size);
+    buffer = nullptr;
+    buffer_size = 0;
+}
+#else
+void CopyPatch::Compile() {}
+
+const CopyPatch::Stencil& CopyPatch::Select(std::size_t) const {
+    static constexpr Stencil none{};
+    return none;
+}
+
+void CopyPatch::Release() {}
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chip8.hpp"
+#include "interpreter.hpp"
+
+// Baseline JIT between the Interpreter and LLVMAOT, compiles a game in microseconds by copying
+// a machine code stencil for each instruction and patching in its operands and jump targets
+// The stencils are compiled from stencils.cpp by clang at build time and cut out of the object by
+// stencil_extractor, so nothing of LLVM runs here
+// Stencils only exist for x86-64 Linux, anywhere else the game runs on the Interpreter
+class CopyPatch final : public Chip8::CPU {
+public:
+    CopyPatch();
+    ~CopyPatch() override;
+
+    void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+
+    struct State;
+    // every stencil has this signature, jumping straight into the code for the next instruction
+    // or returning once the program counter in the state leaves the compiled code
+    using Code = void (*)(Chip8::Interface* interface, State* state);
+
+    // machine state the stencils run on
+    struct State {
+        Chip8::Snapshot machine;
+        std::uint32_t rand;
+        // instructions run and not added to the cycle count of the interface yet
+        std::uint64_t cycles;
+        // set by stores into compiled code, which has to be generated again before running on
+        std::uint32_t invalidated;
+        // code for each address, looked up by RET and JP V0, null outside of the compiled code
+        std::array<Code, 0x1000> code;
+        // bytes the compiled code was generated from
+        std::array<bool, 0x1000> compiled;
+    };
+
+    // what stencils get patched with, HOLE_<name> in stencils.cpp
+    enum class Hole : std::uint8_t {
+        // operands of the instruction
+        X,
+        Y,
+        N,
+        KK,
+        NNN,
+        PC,
+        // instructions in the block starting at the instruction, for the COUNT stencil
+        COUNT,
+        // code to continue at after the instruction, after skipping the next one and at nnn
+        NEXT,
+        SKIP,
+        JUMP,
+        // library functions the compiler calls on its own for copies
+        MEMCPY,
+        MEMSET,
+    };
+    enum class Relocation : std::uint8_t { ABS8, ABS16, ABS32, ABS64, PC32 };
+    struct Patch {
+        std::uint32_t offset;
+        Hole hole;
+        Relocation relocation;
+        std::int32_t addend;
+    };
+    struct Stencil {
+        const std::uint8_t* code;
+        std::size_t size;
+        const Patch* patches;
+        std::size_t patch_count;
+        // whether it ends in a 5 byte jump to NEXT, dropped when the next instruction follows
+        bool falls_through;
+    };
+
+private:
+    // Copy and patch the code reachable from 0x200 and every address the game jumped out to
+    // Blocks start with a COUNT stencil adding their length to the cycle count
+    void Compile();
+    // Stencil for the instruction at address in the current memory
+    const Stencil& Select(std::size_t address) const;
+    void Release();
+
+    State state{};
+    // where Compile starts looking for code
+    std::vector<std::size_t> entries;
+    // executable memory holding the compiled code
+    void* buffer = nullptr;
+    std::size_t buffer_size = 0;
+
+    std::uint64_t compiles = 0;
+    Interpreter fallback;
+};
@@ -0,0 +1,31 @@
+#include <cstring>
+
+#include "copy_patch.hpp"
+#include "cpus.hpp"
+#include "interpreter.hpp"
+#include "llvm_aot.hpp"
+#include "prebuilt.hpp"
+#include "recompiler.hpp"
+#include "tiered.hpp"
+
+std::unique_ptr<Chip8::CPU> MakeCPU(const std::string& name) {
+    if (name == "interpreter")
+        return std::make_unique<Interpreter>(Interpreter::Dispatch::Table);
+    if (name == "threaded")
+        return std::make_unique<Interpreter>(Interpreter::Dispatch::Threaded);
+    if (name == "profile")
+        return std::make_unique<Interpreter>(Interpreter::Dispatch::Profiled);
+    if (name == "aot")
+        return std::make_unique<LLVMAOT>(LLVMAOT::Codegen::IR);
+    if (name == "aot-clang")
+        return std::make_unique<LLVMAOT>(LLVMAOT::Codegen::Source);
+    if (name == "recompiler")
+        return std::make_unique<Recompiler>();
+    if (name == "copy-patch")
+        return std::make_unique<CopyPatch>();
+    if (name == "tiered")
+        return std::make_unique<Tiered>();
+    if (name.rfind("prebuilt=", 0) == 0)
+        return std::make_unique<Prebuilt>(name.substr(std::strlen("prebuilt=")));
+    return nullptr;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <memory>
+#include <string>
+
+#include "chip8.hpp"
+
+// The backend --cpu=name picks: interpreter, threaded, profile, aot, aot-clang, recompiler,
+// copy-patch, tiered or prebuilt=image, nullptr for anything else
+std::unique_ptr<Chip8::CPU> MakeCPU(const std::string& name);
@@ -0,0 +1,57 @@
+#include <system_error>
+
+#include <fmt/format.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "file_watcher.hpp"
+
+#if defined(__linux__)
+FileWatcher::FileWatcher(const std::string& path) : path{std::filesystem::absolute(path)} {
+    inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify < 0 ||
+        inotify_add_watch(inotify, this->path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        fmt::print("can't watch {} for changes\n", path);
+}
+
+FileWatcher::~FileWatcher() {
+    if (inotify >= 0)
+        close(inotify);
+}
+
+bool FileWatcher::Changed() {
+    if (inotify < 0)
+        return false;
+    bool changed = false;
+    alignas(inotify_event) char events[4096];
+    ssize_t length;
+    while ((length = read(inotify, events, sizeof(events))) > 0) {
+        for (auto event = events; event < events + length;) {
+            const auto& header = *reinterpret_cast<const inotify_event*>(event);
+            if (header.len && path.filename() == header.name)
+                changed = true;
+            event += sizeof(inotify_event) + header.len;
+        }
+    }
+    return changed;
+}
+#else
+FileWatcher::FileWatcher(const std::string& path) : path{path} {
+    std::error_code error;
+    last_write = std::filesystem::last_write_time(this->path, error);
+}
+
+FileWatcher::~FileWatcher() = default;
+
+bool FileWatcher::Changed() {
+    std::error_code error;
+    const auto write = std::filesystem::last_write_time(path, error);
+    if (error || write == last_write)
+        return false;
+    last_write = write;
+    return true;
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+#include <filesystem>
+#include <string>
+
+// Notices a file getting written or replaced, polled by the frontend once a frame
+// Watches the directory on Linux so editors that save by renaming over the file are caught too,
+// elsewhere it compares modification times
+class FileWatcher {
+public:
+    explicit FileWatcher(const std::string& path);
+    ~FileWatcher();
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    // whether the file changed since the last call, never blocks
+    bool Changed();
+
+private:
+    std::filesystem::path path;
+#if defined(__linux__)
+    int inotify = -1;
+#else
+    std::filesystem::file_time_type last_write{};
+#endif
+};
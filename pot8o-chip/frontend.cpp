@@ -1,6 +1,7 @@
 #include <array>
 #include <chrono>
 #include <fstream>
+#include <optional>
 #include <thread>
 #include <type_traits>
 #include <fmt/format.h>
@@ -8,14 +9,26 @@
 #include <SDL.h>
 
 #include "chip8.hpp"
+#include "file_watcher.hpp"
 #include "frontend.hpp"
-#include "interpreter.hpp"
-#include "llvm_aot.hpp"
 #include "open_gl.hpp"
 
 constexpr auto WIDTH = 64, HEIGHT = 32;
 
-SDLFrontend::SDLFrontend() : chip8(std::make_unique<LLVMAOT>()) {
+static std::optional<std::vector<std::uint8_t>> ReadGame(const std::string& path) {
+    std::ifstream game(path, std::ios::binary);
+    if (!game) {
+        fmt::print("bad game path: {}", path);
+        return std::nullopt;
+    }
+    return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(game),
+                                     std::istreambuf_iterator<char>());
+}
+
+SDLFrontend::SDLFrontend(std::unique_ptr<Chip8::CPU> cpu, bool watch,
+                         std::uint64_t instructions_per_tick)
+    : watch{watch}, throttled{instructions_per_tick != 0}, chip8(std::move(cpu)) {
+    chip8.Throttle(instructions_per_tick);
     SDL_Init(SDL_INIT_EVERYTHING);
     window = decltype(window)(
         SDL_CreateWindow("pot8o chip", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH * 8,
@@ -67,14 +80,14 @@ SDLFrontend::~SDLFrontend() {
 
 void SDLFrontend::LoadGame(std::string& path) {
     {
-        std::ifstream game(path, std::ios::binary);
-        if (!game) {
-            fmt::print("bad game path: {}", path);
+        auto game = ReadGame(path);
+        if (!game)
             return;
-        }
-        chip8.Run(std::vector<std::uint8_t>(std::istreambuf_iterator<char>(game),
-                                            std::istreambuf_iterator<char>()));
+        chip8.Run(std::move(*game));
     }
+    std::optional<FileWatcher> watcher;
+    if (watch)
+        watcher.emplace(path);
 
     SDL_DisplayMode display_mode;
     SDL_GetWindowDisplayMode(window.get(), &display_mode);
@@ -94,9 +107,29 @@ void SDLFrontend::LoadGame(std::string& path) {
         // SDL_RenderCopy(renderer.get(), texture.get(), nullptr, nullptr);
         // SDL_RenderPresent(renderer.get());
 
+        if (watcher && watcher->Changed()) {
+            if (auto game = ReadGame(path)) {
+                const auto start = std::chrono::steady_clock::now();
+                chip8.Reload(std::move(*game));
+                fmt::print("reloaded {} after {:.3f} s\n", path,
+                           std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                               .count());
+            }
+        }
+
         ++frame_count;
         if (!(frame_count % display_mode.refresh_rate)) {
-            title = fmt::format("pot8o chip - {:0=.2} GHz", chip8.GetCycles() / 1'000'000'000.);
+            if (throttled) {
+                // the timer thread paces throttled games, so show how well it keeps to its ticks
+                const auto drift = chip8.GetTickDrift();
+                title = fmt::format("pot8o chip - {} instructions/s, ticks {:.2f} ms late, at most "
+                                    "{:.2f} ms",
+                                    chip8.GetCycles(), drift.mean.count() / 1e6,
+                                    drift.max.count() / 1e6);
+            } else {
+                title =
+                    fmt::format("pot8o chip - {:0=.2} GHz", chip8.GetCycles() / 1'000'000'000.);
+            }
             SDL_SetWindowTitle(window.get(), title.data());
         }
 
@@ -20,7 +20,11 @@ public:
         void operator()(SDL_GLContext* p) const;
     };
 
-    explicit SDLFrontend();
+    // with watch set, games get reloaded into the running machine whenever their file changes
+    // instructions_per_tick throttles games to that many instructions every 60 Hz tick, 0 runs
+    // them as fast as the CPU can
+    explicit SDLFrontend(std::unique_ptr<Chip8::CPU> cpu, bool watch = false,
+                         std::uint64_t instructions_per_tick = 0);
     ~SDLFrontend();
 
     void LoadGame(std::string& path);
@@ -56,5 +60,7 @@ private:
 
     std::array<std::uint32_t, 64 * 32> pixel_data{};
 
+    bool watch;
+    bool throttled;
     Chip8 chip8;
 };
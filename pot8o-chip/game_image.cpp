@@ -0,0 +1,19 @@
+#include <chrono>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/SHA1.h>
+
+#include "game_image.hpp"
+
+std::uint32_t GameSeed(const Chip8::Interface& interface) {
+    if (interface.seed)
+        return *interface.seed;
+    return static_cast<std::uint32_t>(std::chrono::system_clock::now().time_since_epoch().count());
+}
+
+std::string GameHash(const std::vector<std::uint8_t>& game) {
+    llvm::SHA1 hasher;
+    hasher.update(llvm::ArrayRef<std::uint8_t>(game));
+    return llvm::toHex(hasher.final(), true);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.hpp"
+
+// What native code of a game and whoever runs it agree on, shared by LLVMAOT and the backends
+// that run code it built without linking it
+
+// starts the game from scratch when passed a null snapshot, seed is only used for RND
+using NativeEntry = int (*)(Chip8::Interface* interface, const Chip8::Snapshot* snapshot,
+                            std::uint32_t seed);
+
+// the seed of the interface, or one from the clock
+std::uint32_t GameSeed(const Chip8::Interface& interface);
+// hex SHA1 of the game, images built ahead of time are tagged with it
+std::string GameHash(const std::vector<std::uint8_t>& game);
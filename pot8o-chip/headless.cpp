@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+
+#include "batch_interpreter.hpp"
+#include "chip8.hpp"
+#include "cpus.hpp"
+#include "options.hpp"
+#include "sessions.hpp"
+
+// Runs a game for a number of ticks in virtual time without a window, for servers and batch runs
+// Input comes from a log with one "tick key down|up" line per key event, keys in hex. Every
+// frame can be written out raw, 32 rows of 64 bits each, and a hash of all of them is printed
+// at the end so runs can be compared
+// With --sessions=N it runs N copies of the game at once in real time instead, with seeds counting
+// up from --seed, and prints how each of them did. They run on the threaded interpreter unless
+// --cpu picks aot or another interpreter
+// With --batch=N it runs N copies in virtual time on the batch interpreter, in lockstep on one
+// thread, with seeds counting up from --seed and the same --input on each
+
+static std::optional<std::vector<Chip8::KeyEvent>> ReadInput(const std::string& path) {
+    std::ifstream log(path);
+    if (!log)
+        return std::nullopt;
+    std::vector<Chip8::KeyEvent> input;
+    Chip8::KeyEvent event;
+    std::string state;
+    while (log >> event.tick >> std::hex >> event.key >> std::dec >> state) {
+        if (event.key >= 16 || (state != "down" && state != "up"))
+            return std::nullopt;
+        event.down = state == "down";
+        input.push_back(event);
+    }
+    if (!log.eof())
+        return std::nullopt;
+    std::stable_sort(input.begin(), input.end(),
+                     [](const auto& a, const auto& b) { return a.tick < b.tick; });
+    return input;
+}
+
+static int Usage(const std::string& arg) {
+    fmt::print("bad option: {}\n"
+               "usage: pot8o-headless [--cpu=NAME] [--instructions-per-tick=N] [--ticks=N] "
+               "[--seed=N] [--input=LOG] [--frames=OUT] [--sessions=N | --batch=N] [GAME]\n",
+               arg);
+    return 1;
+}
+
+// FNV-1a over the rows of the frame
+static std::uint64_t Hash(std::uint64_t hash, const Chip8::Frame& frame) {
+    for (auto row : frame)
+        for (int byte = 0; byte < 8; byte++)
+            hash = (hash ^ (row >> byte * 8 & 0xFF)) * 0x100000001B3;
+    return hash;
+}
+
+static int RunSessions(const std::string& cpu, const std::vector<std::uint8_t>& game,
+                       std::uint64_t instructions_per_tick, std::uint64_t ticks,
+                       std::uint32_t seed, std::size_t count) {
+    Sessions sessions;
+    std::vector<Sessions::Id> ids;
+    // written by the worker running the session, read once it is removed
+    std::vector<std::uint64_t> hashes(count, 0xCBF29CE484222325);
+    for (std::size_t i = 0; i < count; i++) {
+        const auto id = sessions.Add(MakeCPU(cpu), game, instructions_per_tick,
+                                     seed + static_cast<std::uint32_t>(i),
+                                     [&hash = hashes[i], ticks](std::uint64_t tick,
+                                                                const Chip8::Frame& frame) {
+                                         if (tick <= ticks)
+                                             hash = Hash(hash, frame);
+                                     });
+        if (!id) {
+            fmt::print("cpu {} can't be stepped\n", cpu);
+            return 1;
+        }
+        ids.push_back(*id);
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(ticks / 60.));
+    for (std::size_t i = 0; i < count; i++) {
+        const auto stats = *sessions.GetStats(ids[i]);
+        sessions.Remove(ids[i]);
+        fmt::print("session {}: {} ticks, {} dropped, {} instructions, busy {:.3f} s, frames hash "
+                   "{:016X}{}\n",
+                   i, stats.ticks, stats.dropped_ticks, stats.instructions,
+                   std::chrono::duration<double>(stats.busy).count(), hashes[i],
+                   stats.ended ? ", ended" : "");
+    }
+    return 0;
+}
+
+static int RunBatch(const std::vector<std::uint8_t>& game, std::uint64_t instructions_per_tick,
+                    std::uint64_t ticks, std::uint32_t seed, std::size_t count,
+                    const std::vector<Chip8::KeyEvent>& input) {
+    BatchInterpreter batch(game, instructions_per_tick);
+    std::vector<std::uint32_t> seeds;
+    for (std::size_t i = 0; i < count; i++)
+        seeds.push_back(seed + static_cast<std::uint32_t>(i));
+    std::vector<std::uint64_t> hashes(count, 0xCBF29CE484222325);
+    const auto start = std::chrono::steady_clock::now();
+    batch.Run(seeds, ticks, {input},
+              [&](std::size_t lane, std::uint64_t, const Chip8::Frame& frame) {
+                  hashes[lane] = Hash(hashes[lane], frame);
+              });
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::uint64_t instructions = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        instructions += batch.GetInstructions(i);
+        fmt::print("lane {}: {} instructions, frames hash {:016X}{}\n", i,
+                   batch.GetInstructions(i), hashes[i], batch.Ended(i) ? ", ended" : "");
+    }
+    fmt::print("{} lanes, {} instructions in {:.3f} s, {:.1f} lanes per instruction\n", count,
+               instructions, elapsed.count(), batch.GetLanesPerGroup());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string path;
+    std::string cpu_name;
+    std::unique_ptr<Chip8::CPU> cpu;
+    std::uint64_t instructions_per_tick = 10;
+    std::uint64_t ticks = 60 * 60;
+    std::uint32_t seed = 0;
+    std::vector<Chip8::KeyEvent> input;
+    std::ofstream frames;
+    std::size_t sessions = 0;
+    std::size_t batch = 0;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.rfind("--cpu=", 0) == 0) {
+            cpu_name = arg.substr(std::strlen("--cpu="));
+            cpu = MakeCPU(cpu_name);
+            if (!cpu) {
+                fmt::print("unknown cpu: {}\n", cpu_name);
+                return 1;
+            }
+        } else if (arg.rfind("--instructions-per-tick=", 0) == 0) {
+            if (!ParseNumber(arg, "--instructions-per-tick=", instructions_per_tick))
+                return Usage(arg);
+        } else if (arg.rfind("--ticks=", 0) == 0) {
+            if (!ParseNumber(arg, "--ticks=", ticks))
+                return Usage(arg);
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            if (!ParseNumber(arg, "--seed=", seed))
+                return Usage(arg);
+        } else if (arg.rfind("--input=", 0) == 0) {
+            const auto log = arg.substr(std::strlen("--input="));
+            const auto events = ReadInput(log);
+            if (!events) {
+                fmt::print("bad input log: {}\n", log);
+                return 1;
+            }
+            input = *events;
+        } else if (arg.rfind("--frames=", 0) == 0) {
+            const auto out = arg.substr(std::strlen("--frames="));
+            frames.open(out, std::ios::binary);
+            if (!frames) {
+                fmt::print("bad frames path: {}\n", out);
+                return 1;
+            }
+        } else if (arg.rfind("--sessions=", 0) == 0) {
+            if (!ParseNumber(arg, "--sessions=", sessions))
+                return Usage(arg);
+        } else if (arg.rfind("--batch=", 0) == 0) {
+            if (!ParseNumber(arg, "--batch=", batch))
+                return Usage(arg);
+        } else if (arg.rfind("--", 0) == 0) {
+            return Usage(arg);
+        } else {
+            path = arg;
+        }
+    }
+    // Tiered would switch tiers whenever its compiler thread is done, which isn't reproducible
+    if (!cpu)
+        cpu = MakeCPU("copy-patch");
+    if (path.empty())
+        std::cin >> path;
+    if (instructions_per_tick == 0) {
+        fmt::print("virtual time needs at least one instruction per tick\n");
+        return 1;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fmt::print("bad game path: {}\n", path);
+        return 1;
+    }
+    std::vector<std::uint8_t> game{std::istreambuf_iterator<char>(file),
+                                   std::istreambuf_iterator<char>()};
+    if (batch != 0) {
+        if (sessions != 0 || frames.is_open()) {
+            fmt::print("--batch doesn't work with --sessions or --frames\n");
+            return 1;
+        }
+        return RunBatch(game, instructions_per_tick, ticks, seed, batch, input);
+    }
+    if (sessions != 0) {
+        if (!input.empty() || frames.is_open()) {
+            fmt::print("--input and --frames only work without --sessions\n");
+            return 1;
+        }
+        // only the interpreter and the IR codegen can share threads
+        return RunSessions(cpu_name.empty() ? "threaded" : cpu_name, game,
+                           instructions_per_tick, ticks, seed, sessions);
+    }
+
+    Chip8 chip8(std::move(cpu));
+    std::uint64_t hash = 0xCBF29CE484222325;
+    std::uint64_t last_tick = 0;
+    const auto start = std::chrono::steady_clock::now();
+    chip8.RunVirtual(std::move(game), instructions_per_tick, ticks, input, seed,
+                     [&](std::uint64_t tick, const Chip8::Frame& frame) {
+                         hash = Hash(hash, frame);
+                         if (frames.is_open())
+                             frames.write(reinterpret_cast<const char*>(frame.data()),
+                                          sizeof(frame));
+                         last_tick = tick;
+                     });
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print("{} ticks, {} instructions in {:.3f} s, frames hash {:016X}\n", last_tick,
+               chip8.GetCycles(), elapsed.count(), hash);
+    for (const auto& stat : chip8.GetCPUStats())
+        fmt::print("{}: {}\n", stat.name, stat.value);
+    return 0;
+}
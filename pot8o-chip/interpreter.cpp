@@ -1,23 +1,287 @@
+#include <algorithm>
+
 #include "font.hpp"
 #include "interpreter.hpp"
 
+// the index into handlers of every entry of table, unknown opcodes are no-ops
+template <std::size_t N, std::size_t H>
+static constexpr std::array<std::uint8_t, N>
+IndexTable(const std::array<void (Interpreter::*)(), N>& table,
+           const std::array<void (Interpreter::*)(), H>& handlers, std::uint8_t no_op) {
+    std::array<std::uint8_t, N> indices{};
+    for (std::size_t i = 0; i < N; i++) {
+        indices[i] = no_op;
+        for (std::size_t op = 0; op < H; op++)
+            if (table[i] != nullptr && handlers[op] == table[i])
+                indices[i] = static_cast<std::uint8_t>(op);
+    }
+    return indices;
+}
+
+constexpr std::array<std::uint8_t, 0x10> Interpreter::opcode_ops =
+    IndexTable(opcode_table, handlers, OP_step);
+constexpr std::array<std::uint8_t, 0x100> Interpreter::opcode_ops_0 =
+    IndexTable(opcode_table_0, handlers, OP_step);
+constexpr std::array<std::uint8_t, 0x10> Interpreter::opcode_ops_8 =
+    IndexTable(opcode_table_8, handlers, OP_step);
+constexpr std::array<std::uint8_t, 0x100> Interpreter::opcode_ops_E =
+    IndexTable(opcode_table_E, handlers, OP_step);
+constexpr std::array<std::uint8_t, 0x100> Interpreter::opcode_ops_F =
+    IndexTable(opcode_table_F, handlers, OP_step);
+
 void Interpreter::Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+    Load(interface, game);
+    Execute();
+
+    if (dispatch == Dispatch::Profiled)
+        profile.Save(game);
+}
+
+bool Interpreter::Load(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
     this->interface = &interface;
-    rng.seed(std::random_device()());
+    rng.seed(interface.seed ? *interface.seed : std::random_device()());
 
-    std::copy(FONT.begin(), FONT.end(), memory.begin());
-    std::copy(game.begin(), game.end(), memory.begin() + 0x200);
+    memory = {};
+    frame_buffer = {};
+    V = {};
+    stack.clear();
+    I = 0;
+    program_counter = 0x200;
 
-    for (;;) {
-        if (program_counter >= 0x1000)
-            return;
-        opcode = memory[program_counter] << 8 | memory[program_counter + 1];
-        (this->*opcode_table[op()])();
+    std::copy(FONT.begin(), FONT.end(), memory.begin());
+    // games past the end of memory are cut off, as on the other backends
+    const auto size = std::min<std::size_t>(game.size(), memory.size() - 0x200);
+    std::copy_n(game.begin(), size, memory.begin() + 0x200);
+    rom_end = 0x200 + size;
+    fused_instructions = {};
+    for (auto& fused : published_fusions)
+        fused = 0;
+    profile = {};
+    cycles = 0;
+    yield_flag = false;
+    prepared = false;
+    return true;
+}
+
+void Interpreter::Execute() {
+    if (dispatch == Dispatch::Threaded)
+        RunThreaded();
+    else if (dispatch == Dispatch::Profiled)
+        RunProfiled();
+    else
+        RunTable();
+    publish();
+    yield_flag = false;
+}
+
+bool Interpreter::Continue() {
+    Execute();
+    return program_counter < 0x1000;
+}
+
+Chip8::Snapshot Interpreter::GetSnapshot() const {
+    Chip8::Snapshot snapshot{};
+    snapshot.memory = memory;
+    snapshot.frame_buffer = frame_buffer;
+    snapshot.V = V;
+    snapshot.stack_ptr = static_cast<std::uint32_t>(stack.size());
+    std::copy_n(stack.begin(), std::min(stack.size(), snapshot.stack.size()),
+                snapshot.stack.begin());
+    snapshot.I = static_cast<std::uint32_t>(I);
+    snapshot.program_counter = static_cast<std::uint32_t>(program_counter);
+    return snapshot;
+}
+
+std::vector<Chip8::Stat> Interpreter::GetStats() const {
+    return {
+        {"fused SE/SNE; JP", published_fusions[SKIP_JP]},
+        {"fused LD I; DRW", published_fusions[LD_I_DRW]},
+        {"fused ADD; SE/SNE; JP", published_fusions[COUNTED_LOOP]},
+        {"fused LD Vx, DT; SE/SNE; JP", published_fusions[TIMER_POLL]},
+    };
+}
+
+void Interpreter::RunTable() {
+    PrepareCache(nullptr, nullptr);
+
+    while (!halted())
+        Step();
+}
+
+void Interpreter::RunProfiled() {
+    PrepareCache(nullptr, nullptr);
+
+    while (!halted()) {
+        const auto address = program_counter;
+        Step();
+        profile.Record(address, program_counter);
     }
 }
 
-void Interpreter::split_0() {
-    (this->*opcode_table_0[kk()])();
+void Interpreter::Step() {
+    if (program_counter & 1) {
+        odd_instruction = Decode(fetch(program_counter));
+        current = &odd_instruction;
+    } else {
+        current = &decode_cache[program_counter >> 1];
+    }
+    count(1);
+    (this->*current->handler)();
+}
+
+Interpreter::DecodedInstruction Interpreter::Decode(std::uint16_t opcode) {
+    DecodedInstruction decoded;
+    decoded.x = (opcode & 0x0F00) >> 8;
+    decoded.y = (opcode & 0x00F0) >> 4;
+    decoded.n = opcode & 0x000F;
+    decoded.kk = opcode & 0x00FF;
+    decoded.nnn = opcode & 0x0FFF;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        decoded.op = opcode_ops_0[decoded.kk];
+        break;
+    case 0x8:
+        decoded.op = opcode_ops_8[decoded.n];
+        break;
+    case 0xE:
+        decoded.op = opcode_ops_E[decoded.kk];
+        break;
+    case 0xF:
+        decoded.op = opcode_ops_F[decoded.kk];
+        break;
+    default:
+        decoded.op = opcode_ops[opcode >> 12];
+    }
+    decoded.handler = handlers[decoded.op];
+    return decoded;
+}
+
+void Interpreter::PrepareCache(const void* const* labels, const void* decode_label) {
+    if (prepared && thread_labels == labels)
+        return;
+    prepared = true;
+    thread_labels = labels;
+    blank_instruction = {};
+    blank_instruction.label = decode_label;
+    decode_cache.fill(blank_instruction);
+
+    for (auto address = (rom_end - 1) & ~std::size_t(1); address >= 0x200; address -= 2)
+        DecodeAt(address);
+}
+
+void Interpreter::DecodeAt(std::size_t address) {
+    Store(decode_cache[address >> 1], Decode(fetch(address)));
+    // a superinstruction would count as a single instruction at its first address
+    if (dispatch != Dispatch::Profiled)
+        Fuse(address);
+}
+
+void Interpreter::Store(DecodedInstruction& entry, const DecodedInstruction& decoded) {
+    entry = decoded;
+    if (thread_labels)
+        entry.label = thread_labels[entry.op];
+}
+
+void Interpreter::Fuse(std::size_t address) {
+    if (address + 6 > memory.size())
+        return;
+    auto& head = decode_cache[address >> 1];
+    const auto second = Decode(fetch(address + 2));
+    const auto third = Decode(fetch(address + 4));
+
+    // OP_step is never a superinstruction
+    std::uint8_t fused = OP_step;
+    std::size_t length = 2;
+    if (head.op == OP_LD_I_addr && second.op == OP_DRW_Vx_Vy_nibble) {
+        fused = OP_LD_I_addr_DRW;
+    } else if (second.op == OP_JP_addr) {
+        if (head.op == OP_SE_Vx_byte)
+            fused = OP_SE_Vx_byte_JP;
+        else if (head.op == OP_SNE_Vx_byte)
+            fused = OP_SNE_Vx_byte_JP;
+        else if (head.op == OP_SE_Vx_Vy)
+            fused = OP_SE_Vx_Vy_JP;
+        else if (head.op == OP_SNE_Vx_Vy)
+            fused = OP_SNE_Vx_Vy_JP;
+    } else if (third.op == OP_JP_addr && second.x == head.x) {
+        length = 3;
+        const bool equal = second.op == OP_SE_Vx_byte;
+        if (!equal && second.op != OP_SNE_Vx_byte)
+            return;
+        if (head.op == OP_ADD_Vx_byte)
+            fused = equal ? OP_ADD_Vx_byte_SE_JP : OP_ADD_Vx_byte_SNE_JP;
+        else if (head.op == OP_LD_Vx_DT)
+            fused = equal ? OP_LD_Vx_DT_SE_JP : OP_LD_Vx_DT_SNE_JP;
+    }
+    if (fused == OP_step)
+        return;
+
+    // the superinstruction reads the operands of the instructions after it from the cache
+    auto follower = &head;
+    for (const auto& decoded : {second, third}) {
+        if (--length == 0)
+            break;
+        if ((++follower)->handler == &Interpreter::decode)
+            Store(*follower, decoded);
+    }
+    head.op = fused;
+    head.handler = handlers[fused];
+    if (thread_labels)
+        head.label = thread_labels[head.op];
+}
+
+void Interpreter::RunThreaded() {
+#if defined(__GNUC__) || defined(__clang__)
+#define HANDLER_LABEL(name) &&op_##name,
+    static constexpr const void* labels[]{INTERPRETER_HANDLERS(HANDLER_LABEL)};
+#undef HANDLER_LABEL
+
+    PrepareCache(labels, &&decode);
+
+    // handlers are non-virtual members in this translation unit, so each one is inlined at its
+    // label and every label ends in its own indirect jump to the next instruction
+#define DISPATCH()                                                                                 \
+    if (halted())                                                                                  \
+        return;                                                                                    \
+    if (program_counter & 1) {                                                                     \
+        odd_instruction = Decode(fetch(program_counter));                                          \
+        odd_instruction.label = labels[odd_instruction.op];                                        \
+        current = &odd_instruction;                                                                \
+    } else {                                                                                       \
+        current = &decode_cache[program_counter >> 1];                                             \
+    }                                                                                              \
+    count(1);                                                                                      \
+    goto* current->label;
+
+    DISPATCH();
+
+decode:
+    DecodeAt(program_counter);
+    goto* current->label;
+
+#define HANDLER_BODY(name)                                                                         \
+    op_##name : name();                                                                            \
+    DISPATCH();
+    INTERPRETER_HANDLERS(HANDLER_BODY)
+#undef HANDLER_BODY
+#undef DISPATCH
+#else
+    RunTable();
+#endif
+}
+
+void Interpreter::decode() {
+    DecodeAt(program_counter);
+    (this->*current->handler)();
+}
+
+void Interpreter::invalidate(std::size_t address, std::size_t length) {
+    // superinstructions starting up to two instructions earlier read the overwritten entries
+    const std::size_t first = std::max<std::size_t>(address >> 1, 2) - 2;
+    const std::size_t last = std::min(address + length - 1, memory.size() - 1) >> 1;
+    for (auto i = first; i <= last; ++i)
+        decode_cache[i] = blank_instruction;
 }
 
 void Interpreter::CLS() {
@@ -64,10 +328,6 @@ void Interpreter::ADD_Vx_byte() {
     step();
 }
 
-void Interpreter::split_8() {
-    (this->*opcode_table_8[n()])();
-}
-
 void Interpreter::LD_Vx_Vy() {
     Vx() = Vy();
     step();
@@ -157,20 +417,12 @@ void Interpreter::DRW_Vx_Vy_nibble() {
     step();
 }
 
-void Interpreter::split_E() {
-    (this->*opcode_table_E[kk()])();
-}
-
 void Interpreter::SKP_Vx() {
-    program_counter += interface->keypad_state[Vx()] ? 4 : 2;
+    program_counter += interface->keypad_state >> (Vx() & 0xF) & 1 ? 4 : 2;
 }
 
 void Interpreter::SKNP_Vx() {
-    program_counter += interface->keypad_state[Vx()] ? 2 : 4;
-}
-
-void Interpreter::split_F() {
-    (this->*opcode_table_F[kk()])();
+    program_counter += interface->keypad_state >> (Vx() & 0xF) & 1 ? 2 : 4;
 }
 
 void Interpreter::LD_Vx_DT() {
@@ -179,11 +431,18 @@ void Interpreter::LD_Vx_DT() {
 }
 
 void Interpreter::LD_Vx_K() {
-    Vx() = [this] {
-        for (auto i = 0;; i = (i + 1) % interface->keypad_state.size())
-            if (interface->keypad_state[i])
-                return i;
-    }();
+    std::uint32_t keys;
+    while (!(keys = interface->keypad_state)) {
+        // leave program_counter here so the instruction is retried if the CPU is ever resumed
+        if (interface->stop_flag || yield_flag)
+            return;
+        publish();
+        interface->wait_for_key(*interface);
+    }
+    std::uint8_t key = 0;
+    while (!(keys >> key & 1))
+        key++;
+    Vx() = key;
     step();
 }
 
@@ -214,11 +473,14 @@ void Interpreter::LD_B_Vx() {
     memory[I + 1] = num / 10;
     num %= 10;
     memory[I + 2] = num;
+    invalidate(I, 3);
     step();
 }
 
 void Interpreter::LD_I_Vx() {
-    std::copy_n(V.begin(), X() + 1, memory.begin() + I);
+    const std::size_t count = X() + 1;
+    std::copy_n(V.begin(), count, memory.begin() + I);
+    invalidate(I, count);
     step();
 }
 
@@ -226,3 +488,57 @@ void Interpreter::LD_Vx_I() {
     std::copy_n(memory.begin() + I, X() + 1, V.begin());
     step();
 }
+
+void Interpreter::SE_Vx_byte_JP() {
+    skip_JP(SKIP_JP, 1, Vx() == kk());
+}
+
+void Interpreter::SNE_Vx_byte_JP() {
+    skip_JP(SKIP_JP, 1, Vx() != kk());
+}
+
+void Interpreter::SE_Vx_Vy_JP() {
+    skip_JP(SKIP_JP, 1, Vx() == Vy());
+}
+
+void Interpreter::SNE_Vx_Vy_JP() {
+    skip_JP(SKIP_JP, 1, Vx() != Vy());
+}
+
+void Interpreter::LD_I_addr_DRW() {
+    LD_I_addr();
+    ++current;
+    DRW_Vx_Vy_nibble();
+    fused_instructions[LD_I_DRW] += 2;
+    count(1);
+}
+
+void Interpreter::ADD_Vx_byte_SE_JP() {
+    ADD_Vx_byte();
+    ++current;
+    skip_JP(COUNTED_LOOP, 2, Vx() == kk());
+}
+
+void Interpreter::ADD_Vx_byte_SNE_JP() {
+    ADD_Vx_byte();
+    ++current;
+    skip_JP(COUNTED_LOOP, 2, Vx() != kk());
+}
+
+void Interpreter::LD_Vx_DT_SE_JP() {
+    const auto address = program_counter;
+    const std::uint32_t seen = interface->event_count;
+    LD_Vx_DT();
+    ++current;
+    skip_JP(TIMER_POLL, 2, Vx() == kk());
+    idle(address, seen);
+}
+
+void Interpreter::LD_Vx_DT_SNE_JP() {
+    const auto address = program_counter;
+    const std::uint32_t seen = interface->event_count;
+    LD_Vx_DT();
+    ++current;
+    skip_JP(TIMER_POLL, 2, Vx() != kk());
+    idle(address, seen);
+}
@@ -1,17 +1,57 @@
+#pragma once
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <random>
 #include <vector>
 
 #include "chip8.hpp"
+#include "profile.hpp"
 
 class Interpreter final : public Chip8::CPU {
 public:
+    enum class Dispatch {
+        // indirect call through the decoded member function pointer after every instruction
+        Table,
+        // computed goto straight to the next handler, falls back to Table without GNU extensions
+        Threaded,
+        // Table without superinstructions, counting every instruction into a Profile that Run
+        // saves for LLVMAOT once the game stops
+        Profiled,
+    };
+
+    explicit Interpreter(Dispatch dispatch = Dispatch::Table) : dispatch{dispatch} {}
+
     void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
 
+    // Reset the machine and load a game without running it, always steppable
+    bool Load(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+    // Run the loaded game until it stops, leaves memory or Yield is called
+    void Execute();
+    // Execute, false once the game left memory
+    bool Continue() override;
+    // Make Execute return at the next instruction boundary, callable from any thread
+    void Yield() {
+        yield_flag = true;
+    }
+    // Run the single instruction at program_counter, which has to be inside memory
+    void Step();
+    Chip8::Snapshot GetSnapshot() const;
+    // counts since the last Load, only recorded with Dispatch::Profiled
+    const Profile& GetProfile() const {
+        return profile;
+    }
+
+    // instructions executed inside superinstructions of each pattern since the last Load
+    std::vector<Chip8::Stat> GetStats() const override;
+
 private:
-    // Call sub-table for opcodes starting with 0x0
-    void split_0();
+    void RunTable();
+    void RunThreaded();
+    void RunProfiled();
+
+    // Decode the instruction at program_counter into the cache, then execute it
+    void decode();
     // Clear the display
     void CLS();
     // Return from a subroutine
@@ -32,8 +72,6 @@ private:
     // Set V[x] to V[x] + kk
     void ADD_Vx_byte();
 
-    // Call sub-table for opcodes starting with 0x8
-    void split_8();
     // Set V[x] to V[y]
     void LD_Vx_Vy();
     // Set V[x] to V[x] | V[y]
@@ -64,15 +102,11 @@ private:
     // Display n-byte sprite starting at memory location I at (V[x], V[y]), set VF = collision
     void DRW_Vx_Vy_nibble();
 
-    // Call sub-table for opcodes starting with 0xE
-    void split_E();
     // Skip next instruction if key with the value of V[x] is pressed
     void SKP_Vx();
     // Skip next instruction if key with the value of V[x] is not pressed
     void SKNP_Vx();
 
-    // Call sub-table for opcodes starting with 0xF
-    void split_F();
     // Set V[x] to DT
     void LD_Vx_DT();
     // Wait for a key press, store the value of the key in V[x]
@@ -92,20 +126,85 @@ private:
     // Read registers V[0] through V[x] from memory starting at location I
     void LD_Vx_I();
 
-    inline void step() {
-        program_counter += 2;
+    // Superinstructions, each runs the instruction at program_counter and the ones after it
+    // SE Vx, kk; JP addr
+    void SE_Vx_byte_JP();
+    // SNE Vx, kk; JP addr
+    void SNE_Vx_byte_JP();
+    // SE Vx, Vy; JP addr
+    void SE_Vx_Vy_JP();
+    // SNE Vx, Vy; JP addr
+    void SNE_Vx_Vy_JP();
+    // LD I, addr; DRW Vx, Vy, n
+    void LD_I_addr_DRW();
+    // ADD Vx, kk; SE Vx, kk; JP addr
+    void ADD_Vx_byte_SE_JP();
+    // ADD Vx, kk; SNE Vx, kk; JP addr
+    void ADD_Vx_byte_SNE_JP();
+    // LD Vx, DT; SE Vx, kk; JP addr
+    void LD_Vx_DT_SE_JP();
+    // LD Vx, DT; SNE Vx, kk; JP addr
+    void LD_Vx_DT_SNE_JP();
+
+    enum Fusion { SKIP_JP, LD_I_DRW, COUNTED_LOOP, TIMER_POLL, FUSION_COUNT };
+    std::array<std::uint64_t, FUSION_COUNT> fused_instructions = {};
+    // fused_instructions as of the last publish, for GetStats on other threads
+    std::array<std::atomic_uint64_t, FUSION_COUNT> published_fusions = {};
+    Profile profile;
+    // instructions run and not added to the cycle count of the interface yet
+    std::uint64_t cycles = 0;
+
+    // Finish a superinstruction ending in a skip over the JP after the current instruction
+    inline void skip_JP(Fusion fusion, std::size_t executed, bool skip) {
+        // the superinstruction itself was counted as one
+        if (skip) {
+            program_counter += 4;
+            fused_instructions[fusion] += executed;
+            count(executed - 1);
+        } else {
+            program_counter = current[1].nnn;
+            fused_instructions[fusion] += executed + 1;
+            count(executed);
+        }
     }
 
-    inline std::uint8_t op() {
-        return (opcode & 0xF000) >> 12;
+    // A timer poll that jumped back to itself can't make progress until the timer thread ticks or a
+    // key changes, so park the thread instead of spinning
+    inline void idle(std::size_t address, std::uint32_t seen) {
+        if (program_counter == address) {
+            publish();
+            interface->wait_for_event(*interface, seen);
+        }
+    }
+
+    // Count instructions run, only adding them to the interface once the instruction budget is
+    // used up so the hot loop stays off the cache line the frontend reads, then wait for the next
+    // tick if throttled
+    inline void count(std::uint64_t instructions) {
+        cycles += instructions;
+        if (cycles >= interface->instruction_budget) {
+            publish();
+            interface->wait_for_tick(*interface);
+        }
+    }
+
+    inline void publish() {
+        interface->cycle_count.fetch_add(cycles, std::memory_order_relaxed);
+        cycles = 0;
+        for (std::size_t fusion = 0; fusion < FUSION_COUNT; fusion++)
+            published_fusions[fusion].store(fused_instructions[fusion], std::memory_order_relaxed);
+    }
+
+    inline void step() {
+        program_counter += 2;
     }
 
     inline std::uint8_t X() {
-        return (opcode & 0x0F00) >> 8;
+        return current->x;
     }
 
     inline std::uint8_t Y() {
-        return (opcode & 0x00F0) >> 4;
+        return current->y;
     }
 
     inline std::uint8_t& Vx() {
@@ -117,19 +216,35 @@ private:
     }
 
     inline std::uint8_t n() {
-        return opcode & 0x000F;
+        return current->n;
     }
 
     inline std::uint8_t kk() {
-        return opcode & 0x00FF;
+        return current->kk;
     }
 
     inline std::size_t nnn() {
-        return opcode & 0x0FFF;
+        return current->nnn;
+    }
+
+    inline std::uint16_t fetch(std::size_t address) const {
+        return memory[address] << 8 | memory[address + 1];
+    }
+
+    // drop cached decodes overlapping a write of length bytes at address
+    void invalidate(std::size_t address, std::size_t length);
+
+    inline bool halted() const {
+        return program_counter >= 0x1000 ||
+               interface->stop_flag.load(std::memory_order_relaxed) ||
+               yield_flag.load(std::memory_order_relaxed);
     }
 
     friend struct Chip8::Interface;
     Chip8::Interface* interface;
+    std::atomic_bool yield_flag = false;
+
+    Dispatch dispatch;
 
     // used for random number generation in intruction 0xC
     std::mt19937 rng;
@@ -142,21 +257,111 @@ private:
     std::array<std::uint8_t, 16> V = {};
     // contains addresses to return from calls
     std::vector<std::size_t> stack;
+
+    using Instruction = decltype(&Interpreter::step);
+
+    // an instruction with its handler resolved and its operands pre-extracted
+    struct DecodedInstruction {
+        Instruction handler = &Interpreter::decode;
+        // only used by the threaded core, where a label of nullptr means not yet decoded
+        const void* label = nullptr;
+        // index into handlers
+        std::uint8_t op = 0;
+        std::uint8_t x = 0, y = 0, n = 0, kk = 0;
+        std::uint16_t nnn = 0;
+    };
+
+    static DecodedInstruction Decode(std::uint16_t opcode);
+
+    // Reset the cache and decode the game up front so superinstructions are fused at load time
+    // Only does so after a Load or a change of the dispatch core, so stepping keeps the cache
+    void PrepareCache(const void* const* labels, const void* decode_label);
+    // Decode the even address into the cache and fuse it with the instructions after it
+    void DecodeAt(std::size_t address);
+    void Store(DecodedInstruction& entry, const DecodedInstruction& decoded);
+    void Fuse(std::size_t address);
+
+    // one entry per even address, instructions at odd addresses are decoded on every execution
+    std::array<DecodedInstruction, 0x800> decode_cache;
+    // what invalidated entries are reset to, the threaded core points its label at the decoder
+    DecodedInstruction blank_instruction;
+    // label of every handler when running the threaded core
+    const void* const* thread_labels = nullptr;
+    // whether the cache holds the game of the last Load for the core thread_labels belongs to
+    bool prepared = false;
+    DecodedInstruction odd_instruction;
     // current instruction
-    std::size_t opcode = 0;
+    DecodedInstruction* current = nullptr;
     // contains a single memory address
     std::size_t I = 0;
     // location in memory corresponding to the current instruction
     std::size_t program_counter = 0x200;
+    // first address past the loaded game
+    std::size_t rom_end = 0x200;
 
-    using Instruction = decltype(&Interpreter::step);
+    // every handler an instruction can decode to, in the order the threaded core lays out its labels
+#define INTERPRETER_HANDLERS(X)                                                                    \
+    X(step)                                                                                        \
+    X(CLS)                                                                                         \
+    X(RET)                                                                                         \
+    X(JP_addr)                                                                                     \
+    X(CALL_addr)                                                                                   \
+    X(SE_Vx_byte)                                                                                  \
+    X(SNE_Vx_byte)                                                                                 \
+    X(SE_Vx_Vy)                                                                                    \
+    X(LD_Vx_byte)                                                                                  \
+    X(ADD_Vx_byte)                                                                                 \
+    X(LD_Vx_Vy)                                                                                    \
+    X(OR_Vx_Vy)                                                                                    \
+    X(AND_Vx_Vy)                                                                                   \
+    X(XOR_Vx_Vy)                                                                                   \
+    X(ADD_Vx_Vy)                                                                                   \
+    X(SUB_Vx_Vy)                                                                                   \
+    X(SHR_Vx)                                                                                      \
+    X(SUBN_Vx_Vy)                                                                                  \
+    X(SHL_Vx)                                                                                      \
+    X(SNE_Vx_Vy)                                                                                   \
+    X(LD_I_addr)                                                                                   \
+    X(JP_V0_addr)                                                                                  \
+    X(RND_Vx_byte)                                                                                 \
+    X(DRW_Vx_Vy_nibble)                                                                            \
+    X(SKP_Vx)                                                                                      \
+    X(SKNP_Vx)                                                                                     \
+    X(LD_Vx_DT)                                                                                    \
+    X(LD_Vx_K)                                                                                     \
+    X(LD_DT_Vx)                                                                                    \
+    X(LD_ST_Vx)                                                                                    \
+    X(ADD_I_Vx)                                                                                    \
+    X(LD_F_Vx)                                                                                     \
+    X(LD_B_Vx)                                                                                     \
+    X(LD_I_Vx)                                                                                     \
+    X(LD_Vx_I)                                                                                     \
+    X(SE_Vx_byte_JP)                                                                               \
+    X(SNE_Vx_byte_JP)                                                                              \
+    X(SE_Vx_Vy_JP)                                                                                 \
+    X(SNE_Vx_Vy_JP)                                                                                \
+    X(LD_I_addr_DRW)                                                                               \
+    X(ADD_Vx_byte_SE_JP)                                                                           \
+    X(ADD_Vx_byte_SNE_JP)                                                                          \
+    X(LD_Vx_DT_SE_JP)                                                                              \
+    X(LD_Vx_DT_SNE_JP)
+
+#define HANDLER_ADDRESS(name) &Interpreter::name,
+    static constexpr std::array handlers{INTERPRETER_HANDLERS(HANDLER_ADDRESS)};
+#undef HANDLER_ADDRESS
+
+    // index of every handler into handlers
+#define HANDLER_OP(name) OP_##name,
+    enum Op : std::uint8_t { INTERPRETER_HANDLERS(HANDLER_OP) };
+#undef HANDLER_OP
 
     // clang-format off
+	// opcodes starting with 0x0, 0x8, 0xE and 0xF are resolved through their sub-tables in Decode
 	static constexpr std::array<Instruction, 0x10>	opcode_table{
-		&Interpreter::split_0,		&Interpreter::JP_addr,			&Interpreter::CALL_addr,	&Interpreter::SE_Vx_byte,
+		nullptr,					&Interpreter::JP_addr,			&Interpreter::CALL_addr,	&Interpreter::SE_Vx_byte,
 		&Interpreter::SNE_Vx_byte,	&Interpreter::SE_Vx_Vy,			&Interpreter::LD_Vx_byte,	&Interpreter::ADD_Vx_byte,
-		&Interpreter::split_8,		&Interpreter::SNE_Vx_Vy,		&Interpreter::LD_I_addr,	&Interpreter::JP_V0_addr,
-		&Interpreter::RND_Vx_byte,	&Interpreter::DRW_Vx_Vy_nibble,	&Interpreter::split_E,		&Interpreter::split_F
+		nullptr,					&Interpreter::SNE_Vx_Vy,		&Interpreter::LD_I_addr,	&Interpreter::JP_V0_addr,
+		&Interpreter::RND_Vx_byte,	&Interpreter::DRW_Vx_Vy_nibble,	nullptr,					nullptr
 	};
 
 	static constexpr std::array<Instruction, 0x100> opcode_table_0 = []{
@@ -195,4 +400,12 @@ private:
 		return table;
 	}();
     // clang-format on
+
+    // the opcode tables as indices into handlers, worked out at compile time in interpreter.cpp so
+    // Decode doesn't have to search for them
+    static const std::array<std::uint8_t, 0x10> opcode_ops;
+    static const std::array<std::uint8_t, 0x100> opcode_ops_0;
+    static const std::array<std::uint8_t, 0x10> opcode_ops_8;
+    static const std::array<std::uint8_t, 0x100> opcode_ops_E;
+    static const std::array<std::uint8_t, 0x100> opcode_ops_F;
 };
@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <chrono>
-#include <fstream>
 #include <functional>
+#include <utility>
+#include <vector>
 
 #include <fmt/format.h>
 
@@ -11,12 +13,12 @@
 #include <clang/Basic/FileManager.h>
 #include <clang/Basic/FileSystemOptions.h>
 #include <clang/Basic/LangOptions.h>
-#include <clang/Basic/MemoryBufferCache.h>
 #include <clang/Basic/SourceManager.h>
 #include <clang/Basic/TargetInfo.h>
 #include <clang/CodeGen/CodeGenAction.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
 #include <clang/Lex/HeaderSearch.h>
 #include <clang/Lex/HeaderSearchOptions.h>
@@ -25,21 +27,46 @@
 #include <clang/Parse/ParseAST.h>
 #include <clang/Sema/Sema.h>
 
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
-#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/DataLayout.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/IR/Verifier.h>
 #include <llvm/InitializePasses.h>
+#include <llvm/Object/ObjectFile.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
 #include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/SHA1.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/IPO/Internalize.h>
 
 #include "aot_ops.hpp"
 #include "font.hpp"
 #include "llvm_aot.hpp"
+#include "llvm_ir.hpp"
+
+// the linker the build was configured with links images built ahead of time
+#ifndef POT8O_LINKER
+#define POT8O_LINKER "ld"
+#endif
 
 constexpr auto EXECUTION_OFFSET = 0x200;
 #define ADDR "{:#3X}"
@@ -48,43 +75,241 @@ constexpr auto EXECUTION_OFFSET = 0x200;
 
 // http://blog.audio-tk.com/2018/09/18/compiling-c-code-in-memory-with-clang/
 void InitializeLLVM() {
-    static bool LLVMinit = false;
-    if (LLVMinit) {
-        return;
+    // LLVM backends of several Sessions can get here at once, the static runs this exactly once
+    [[maybe_unused]] static const bool initialized = [] {
+        // We have not initialized any pass managers for any device yet.
+        // Run the global LLVM pass initialization functions.
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+
+        auto& Registry = *llvm::PassRegistry::getPassRegistry();
+
+        llvm::initializeCore(Registry);
+        llvm::initializeScalarOpts(Registry);
+        llvm::initializeVectorization(Registry);
+        llvm::initializeIPO(Registry);
+        llvm::initializeAnalysis(Registry);
+        llvm::initializeTransformUtils(Registry);
+        llvm::initializeInstCombine(Registry);
+        llvm::initializeInstrumentation(Registry);
+        llvm::initializeTarget(Registry);
+        return true;
+    }();
+}
+
+// Write contents to path through a temporary file next to it that gets renamed into place, so
+// other processes and threads only ever see the whole file
+bool WriteAtomically(const std::string& path, llvm::StringRef contents) {
+    llvm::SmallString<128> temp;
+    int fd;
+    if (auto error = llvm::sys::fs::createUniqueFile(path + ".%%%%%%%%.tmp", fd, temp)) {
+        fmt::print("failed to write {}: {}\n", path, error.message());
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream file(fd, true);
+        file << contents;
+        file.close();
+        if (const auto error = file.error()) {
+            file.clear_error();
+            fmt::print("failed to write {}: {}\n", path, error.message());
+            llvm::sys::fs::remove(temp);
+            return false;
+        }
+    }
+    if (auto error = llvm::sys::fs::rename(temp, path)) {
+        fmt::print("failed to write {}: {}\n", path, error.message());
+        llvm::sys::fs::remove(temp);
+        return false;
+    }
+    return true;
+}
+
+// Keeps compiled objects in the user cache directory, named after the module identifier
+class AOTObjectCache final : public llvm::ObjectCache {
+public:
+    AOTObjectCache() {
+        if (llvm::sys::path::cache_directory(directory))
+            llvm::sys::path::append(directory, "pot8o-chip", "aot");
+        else
+            directory = "aot_cache";
+        llvm::sys::fs::create_directories(directory);
+    }
+
+    // objects that turn out not to parse are dropped by getObject, which then compiles them anew
+    bool Contains(const std::string& key) const {
+        return llvm::sys::fs::exists(PathOf(key));
+    }
+
+    // nullptr for a miss, which includes objects that don't parse, say from an older version
+    std::unique_ptr<llvm::MemoryBuffer> Load(const std::string& key) const {
+        auto object = llvm::MemoryBuffer::getFile(PathOf(key));
+        if (!object)
+            return nullptr;
+        if (auto parsed = llvm::object::ObjectFile::createObjectFile((*object)->getMemBufferRef());
+            !parsed) {
+            llvm::consumeError(parsed.takeError());
+            llvm::sys::fs::remove(PathOf(key));
+            return nullptr;
+        }
+        return std::move(*object);
+    }
+
+    void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override {
+        WriteAtomically(PathOf(module->getModuleIdentifier()), object.getBuffer());
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override {
+        return Load(module->getModuleIdentifier());
+    }
+
+    std::string PathOf(llvm::StringRef key, llvm::StringRef extension = ".o") const {
+        llvm::SmallString<128> path = directory;
+        llvm::sys::path::append(path, key + extension);
+        return path.str().str();
     }
-    // We have not initialized any pass managers for any device yet.
-    // Run the global LLVM pass initialization functions.
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();
 
-    auto& Registry = *llvm::PassRegistry::getPassRegistry();
+private:
 
-    llvm::initializeCore(Registry);
-    llvm::initializeScalarOpts(Registry);
-    llvm::initializeVectorization(Registry);
-    llvm::initializeIPO(Registry);
-    llvm::initializeAnalysis(Registry);
-    llvm::initializeTransformUtils(Registry);
-    llvm::initializeInstCombine(Registry);
-    llvm::initializeInstrumentation(Registry);
-    llvm::initializeTarget(Registry);
+    llvm::SmallString<128> directory;
+};
+
+// Everything besides the source itself that changes the object code
+constexpr char COMPILE_OPTIONS[] = "gnu++17 -O3 -mcmodel=large -fexceptions " LLVM_VERSION_STRING;
+
+// "+feature,-feature,...", sorted so the key doesn't depend on the map's order
+std::string HostCPUFeatures() {
+    llvm::StringMap<bool> features;
+    if (!llvm::sys::getHostCPUFeatures(features))
+        return {};
+    std::vector<std::string> flags;
+    for (const auto& feature : features)
+        flags.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+    std::sort(flags.begin(), flags.end());
+    return llvm::join(flags, ",");
+}
+
+// source has to include everything the code was compiled from, AOT_OPS included
+std::string CacheKey(const std::string& source) {
+    llvm::SHA1 hasher;
+    hasher.update(source);
+    hasher.update(COMPILE_OPTIONS);
+    hasher.update(llvm::sys::getProcessTriple());
+    // the JIT targets the host CPU, so objects don't carry over to another one
+    hasher.update(llvm::sys::getHostCPUName());
+    hasher.update(HostCPUFeatures());
+    return llvm::toHex(hasher.final(), true);
+}
+
+AOTObjectCache& ObjectCache() {
+    static AOTObjectCache cache;
+    return cache;
+}
+
+void Optimize(llvm::Module& module, llvm::TargetMachine* targetMachine) {
+    llvm::PassBuilder passBuilder(targetMachine);
+    llvm::LoopAnalysisManager loopAnalysisManager;
+    llvm::FunctionAnalysisManager functionAnalysisManager;
+    llvm::CGSCCAnalysisManager cGSCCAnalysisManager;
+    llvm::ModuleAnalysisManager moduleAnalysisManager;
+
+    passBuilder.registerModuleAnalyses(moduleAnalysisManager);
+    passBuilder.registerCGSCCAnalyses(cGSCCAnalysisManager);
+    passBuilder.registerFunctionAnalyses(functionAnalysisManager);
+    passBuilder.registerLoopAnalyses(loopAnalysisManager);
+    passBuilder.crossRegisterProxies(loopAnalysisManager, functionAnalysisManager,
+                                     cGSCCAnalysisManager, moduleAnalysisManager);
 
-    LLVMinit = true;
+    llvm::ModulePassManager modulePassManager =
+        passBuilder.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O3);
+    modulePassManager.run(module, moduleAnalysisManager);
 }
 
-std::function<void()> Compile() {
+// compiles objects for the JIT, going through the object cache
+llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>>
+CreateCompiler(llvm::orc::JITTargetMachineBuilder builder) {
+    auto targetMachine = builder.createTargetMachine();
+    if (!targetMachine)
+        return targetMachine.takeError();
+    return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*targetMachine),
+                                                               &ObjectCache());
+}
+
+// module identifier of IR games, whose partitions get cached under a hash of their own IR
+constexpr char CONTENT_KEYED[] = "pot8o-ir";
+
+// The JIT compiles each module with the object cache, which hands back the cached object
+// instead of running codegen when it has one for the module identifier
+// Modules also go through the optimizer on the way there, unless their object is cached
+std::unique_ptr<llvm::orc::LLLazyJIT> CreateJIT() {
     InitializeLLVM();
+    auto targetMachineBuilder = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!targetMachineBuilder) {
+        fmt::print("failed to detect host: {}\n", llvm::toString(targetMachineBuilder.takeError()));
+        return nullptr;
+    }
+    targetMachineBuilder->setCodeGenOptLevel(llvm::CodeGenOpt::Level::Aggressive);
+    auto targetMachine = targetMachineBuilder->createTargetMachine();
+    if (!targetMachine) {
+        fmt::print("failed to create target machine: {}\n",
+                   llvm::toString(targetMachine.takeError()));
+        return nullptr;
+    }
 
-    auto diagnosticOptions = new clang::DiagnosticOptions();
-    llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> ids;
-    // presumably llvm will clean this up later...
-    auto textDiagnosticPrinter = new clang::TextDiagnosticPrinter(llvm::outs(), diagnosticOptions);
-    llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diagnosticsEngine(
-        new clang::DiagnosticsEngine(ids, diagnosticOptions, textDiagnosticPrinter));
+    auto jit = llvm::orc::LLLazyJITBuilder()
+                   .setJITTargetMachineBuilder(*targetMachineBuilder)
+                   .setCompileFunctionCreator(CreateCompiler)
+                   .create();
+    if (!jit) {
+        fmt::print("failed to create JIT: {}\n", llvm::toString(jit.takeError()));
+        return nullptr;
+    }
 
-    clang::CompilerInstance compilerInstance;
-    compilerInstance.createDiagnostics(textDiagnosticPrinter, false);
+    // generated code calls memcpy and friends
+    (*jit)->getMainJITDylib().addGenerator(
+        llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            (*jit)->getDataLayout().getGlobalPrefix())));
+    (*jit)->getIRTransformLayer().setTransform(
+        [targetMachine = std::shared_ptr<llvm::TargetMachine>(std::move(*targetMachine))](
+            llvm::orc::ThreadSafeModule module, const llvm::orc::MaterializationResponsibility&) {
+            module.withModuleDo([&](llvm::Module& module) {
+                // a subroutine that is the same in an edited game keeps its key, so only the
+                // ones the edit touched get optimized and compiled again
+                if (llvm::StringRef(module.getModuleIdentifier()).startswith(CONTENT_KEYED)) {
+                    std::string ir;
+                    llvm::raw_string_ostream ir_stream(ir);
+                    module.print(ir_stream, nullptr);
+                    module.setModuleIdentifier(CacheKey(ir_stream.str()));
+                }
+                if (!ObjectCache().Contains(module.getModuleIdentifier()))
+                    Optimize(module, targetMachine.get());
+            });
+            return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(module));
+        });
+    return std::move(*jit);
+}
+
+template <typename Function = LLVMAOT::Entry>
+Function Lookup(llvm::orc::LLLazyJIT& jit, llvm::StringRef name = "pot8o_main") {
+    auto symbol = jit.lookup(name);
+    if (!symbol) {
+        fmt::print("{}\n", llvm::toString(symbol.takeError()));
+        return nullptr;
+    }
+    // lookups return an ExecutorAddr since LLVM 15, a JITEvaluatedSymbol before that
+#if LLVM_VERSION_MAJOR >= 15
+    return symbol->toPtr<Function>();
+#else
+    return reinterpret_cast<Function>(symbol->getAddress());
+#endif
+}
+
+// Set up clang for compiling input, the same way for the prelude and the games built on it since
+// clang rejects precompiled headers built with different options
+void ConfigureCompiler(clang::CompilerInstance& compilerInstance, const std::string& input) {
+    compilerInstance.createDiagnostics(
+        new clang::TextDiagnosticPrinter(llvm::outs(), new clang::DiagnosticOptions()), true);
     auto& compilerInvocation = compilerInstance.getInvocation();
     std::string triple = llvm::sys::getProcessTriple();
 
@@ -95,119 +320,564 @@ std::function<void()> Compile() {
     compilerInvocation.getLangOpts()->CXXExceptions = true;
 
     compilerInvocation.getFrontendOpts().Inputs = {
-        clang::FrontendInputFile("source.cpp", clang::InputKind::CXX)};
+        clang::FrontendInputFile(input, clang::InputKind::CXX)};
 
     compilerInvocation.getTargetOpts().Triple = triple;
     auto& codeGenOptions = compilerInvocation.getCodeGenOpts();
     codeGenOptions.CodeModel = "large";
     codeGenOptions.ThreadModel = "posix";
     codeGenOptions.OptimizationLevel = 3;
+}
+
+// The precompiled AOT_OPS and how long parsing them without it takes, if that was measured
+struct Prelude {
+    std::string header;
+    std::optional<double> parse_time;
+};
+
+// Seconds a plain parse of the prelude took when its header was built, kept next to the header
+std::optional<double> ParseTime(const std::string& path) {
+    auto contents = llvm::MemoryBuffer::getFile(path);
+    double seconds;
+    if (!contents || (*contents)->getBuffer().trim().getAsDouble(seconds))
+        return std::nullopt;
+    return seconds;
+}
+
+// Precompiles AOT_OPS into the cache directory the first time it or the compile options change,
+// so compiling a game only parses the code generated for it, nullopt if clang couldn't
+const std::optional<Prelude>& PrecompiledPrelude() {
+    static const auto prelude = []() -> std::optional<Prelude> {
+        const auto key = CacheKey(AOT_OPS);
+        const auto header = ObjectCache().PathOf(key, ".pch");
+        const auto timing = ObjectCache().PathOf(key, ".time");
+        // the header only stays valid as long as the file it was built from, so that one is never
+        // written over once it exists, other processes may be using headers built from it
+        const auto source = ObjectCache().PathOf(key, ".hpp");
+        if (!llvm::sys::fs::exists(source)) {
+            const auto temp = source + ".tmp";
+            if (!WriteAtomically(temp, AOT_OPS))
+                return std::nullopt;
+            // a link fails if another process got there first, which leaves its file alone
+            llvm::sys::fs::create_hard_link(temp, source);
+            llvm::sys::fs::remove(temp);
+        }
+        if (llvm::sys::fs::exists(header))
+            return Prelude{header, ParseTime(timing)};
+
+        // what every compile would spend on the prelude without the header, to report the savings
+        auto start = std::chrono::steady_clock::now();
+        std::optional<double> parse_time;
+        {
+            clang::CompilerInstance compilerInstance;
+            ConfigureCompiler(compilerInstance, source);
+            clang::SyntaxOnlyAction action;
+            if (compilerInstance.ExecuteAction(action)) {
+                parse_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                                 .count();
+                WriteAtomically(timing, fmt::format("{}", *parse_time));
+            }
+        }
+
+        start = std::chrono::steady_clock::now();
+        llvm::SmallString<128> temp;
+        llvm::sys::fs::createUniquePath(header + ".%%%%%%%%.tmp", temp, false);
+        clang::CompilerInstance compilerInstance;
+        ConfigureCompiler(compilerInstance, source);
+        compilerInstance.getFrontendOpts().OutputFile = temp.str().str();
+        clang::GeneratePCHAction action;
+        if (!compilerInstance.ExecuteAction(action) || llvm::sys::fs::rename(temp, header)) {
+            llvm::sys::fs::remove(temp);
+            fmt::print("failed to precompile the prelude, parsing it with every game instead\n");
+            return std::nullopt;
+        }
+        fmt::print("precompiled the prelude in {:.3f} s\n",
+                   std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return Prelude{header, parse_time};
+    }();
+    return prelude;
+}
+
+// Runs clang over source in a file of its own, so compiles on other threads and processes don't
+// get in each other's way, on top of the precompiled header if there is one
+std::unique_ptr<llvm::Module> CompileFile(const std::string& source, const std::string* header,
+                                          llvm::LLVMContext& context) {
+    llvm::SmallString<128> path;
+    int fd;
+    if (auto error = llvm::sys::fs::createTemporaryFile("pot8o-game", "cpp", fd, path)) {
+        fmt::print("failed to write the source: {}\n", error.message());
+        return nullptr;
+    }
+    {
+        llvm::raw_fd_ostream file(fd, true);
+        file << source;
+        file.close();
+        if (const auto error = file.error()) {
+            file.clear_error();
+            fmt::print("failed to write the source: {}\n", error.message());
+            llvm::sys::fs::remove(path);
+            return nullptr;
+        }
+    }
+
+    clang::CompilerInstance compilerInstance;
+    ConfigureCompiler(compilerInstance, path.str().str());
+    if (header)
+        compilerInstance.getPreprocessorOpts().ImplicitPCHInclude = *header;
 
-    llvm::LLVMContext context;
     clang::EmitAssemblyAction action(&context);
+    const auto compiled = compilerInstance.ExecuteAction(action);
+    llvm::sys::fs::remove(path);
+    if (!compiled)
+        return nullptr;
+    return action.takeModule();
+}
 
-    if (!compilerInstance.ExecuteAction(action)) {
+// Runs clang over the generated source, returns nullptr if it doesn't compile
+std::unique_ptr<llvm::Module> CompileToModule(const std::string& source,
+                                              llvm::LLVMContext& context) {
+    if (const auto& prelude = PrecompiledPrelude()) {
+        const auto start = std::chrono::steady_clock::now();
+        if (auto module = CompileFile(source, &prelude->header, context)) {
+            const auto seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (prelude->parse_time)
+                fmt::print("compiled on the precompiled prelude in {:.3f} s, saving the {:.3f} s "
+                           "parsing it takes\n",
+                           seconds, *prelude->parse_time);
+            else
+                fmt::print("compiled on the precompiled prelude in {:.3f} s\n", seconds);
+            return module;
+        }
+        // clang also fails on a header it doesn't accept anymore, say one a different build of it
+        // left in the cache
+        fmt::print("compiling again without the precompiled prelude\n");
+    }
+    auto module = CompileFile(AOT_OPS + source, nullptr, context);
+    if (!module)
         fmt::print("compilation failed\n");
-        return nullptr;
+    return module;
+}
+
+LLVMAOT::Entry CompileSource(llvm::orc::LLLazyJIT& jit, const std::string& source,
+                             const std::string& key) {
+    if (auto object = ObjectCache().Load(key)) {
+        fmt::print("loading compiled game {} from cache\n", key);
+        if (auto error = jit.addObjectFile(std::move(object))) {
+            fmt::print("{}\n", llvm::toString(std::move(error)));
+            return nullptr;
+        }
+        return Lookup(jit);
     }
 
-    std::unique_ptr<llvm::Module> module = action.takeModule();
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = CompileToModule(source, *context);
+    if (!module)
+        return nullptr;
+    module->setModuleIdentifier(key);
+    // the generated C++ is a single function, so there is nothing to compile lazily
+    if (auto error =
+            jit.addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))) {
+        fmt::print("{}\n", llvm::toString(std::move(error)));
+        return nullptr;
+    }
+    return Lookup(jit);
+};
 
-    llvm::PassBuilder passBuilder;
-    llvm::LoopAnalysisManager loopAnalysisManager(codeGenOptions.DebugPassManager);
-    llvm::FunctionAnalysisManager functionAnalysisManager(codeGenOptions.DebugPassManager);
-    llvm::CGSCCAnalysisManager cGSCCAnalysisManager(codeGenOptions.DebugPassManager);
-    llvm::ModuleAnalysisManager moduleAnalysisManager(codeGenOptions.DebugPassManager);
+// Links object into a shared library at path with the linker the build was configured with,
+// through temporary files so nobody sees half a library
+bool LinkSharedLibrary(llvm::StringRef object, const std::string& path) {
+    const auto linker = llvm::sys::findProgramByName(POT8O_LINKER);
+    if (!linker) {
+        fmt::print("no linker to link {} with\n", path);
+        return false;
+    }
+    llvm::SmallString<128> input, output;
+    int fd;
+    if (auto error = llvm::sys::fs::createTemporaryFile("pot8o-game", "o", fd, input)) {
+        fmt::print("failed to write the object file: {}\n", error.message());
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream file(fd, true);
+        file << object;
+        file.close();
+        if (const auto error = file.error()) {
+            file.clear_error();
+            fmt::print("failed to write the object file: {}\n", error.message());
+            llvm::sys::fs::remove(input);
+            return false;
+        }
+    }
+    llvm::sys::fs::createUniquePath(path + ".%%%%%%%%.tmp", output, false);
+    const llvm::StringRef arguments[]{*linker, "-shared", "-o", output, input};
+    std::string error;
+    const auto failed = llvm::sys::ExecuteAndWait(*linker, arguments, {}, {}, 0, 0, &error);
+    llvm::sys::fs::remove(input);
+    if (failed) {
+        fmt::print("failed to link {}: {}\n", path, error);
+        llvm::sys::fs::remove(output);
+        return false;
+    }
+    if (auto rename_error = llvm::sys::fs::rename(output, path)) {
+        fmt::print("failed to write {}: {}\n", path, rename_error.message());
+        llvm::sys::fs::remove(output);
+        return false;
+    }
+    return true;
+}
 
-    passBuilder.registerModuleAnalyses(moduleAnalysisManager);
-    passBuilder.registerCGSCCAnalyses(cGSCCAnalysisManager);
-    passBuilder.registerFunctionAnalyses(functionAnalysisManager);
-    passBuilder.registerLoopAnalyses(loopAnalysisManager);
-    passBuilder.crossRegisterProxies(loopAnalysisManager, functionAnalysisManager,
-                                     cGSCCAnalysisManager, moduleAnalysisManager);
+LLVMAOT::Entry CompileIR(llvm::orc::LLLazyJIT& jit, const ControlFlow& flow,
+                         const Profile* profile) {
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = IREmitter(*context).Emit(flow, profile);
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        fmt::print("generated invalid IR\n");
+        return nullptr;
+    }
 
-    llvm::ModulePassManager modulePassManager =
-        passBuilder.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O3);
-    modulePassManager.run(*module, moduleAnalysisManager);
+    // the JIT partitions the module by subroutine and keys each partition by its unoptimized IR,
+    // which covers both the code and the emitter that lowered it
+    module->setModuleIdentifier(CONTENT_KEYED);
 
-    llvm::EngineBuilder builder(std::move(module));
-    builder.setMCJITMemoryManager(std::make_unique<llvm::SectionMemoryManager>());
-    builder.setOptLevel(llvm::CodeGenOpt::Level::Aggressive);
-    auto executionEngine = builder.create();
+    // only pot8o_main gets compiled here, subroutines on their first CALL
+    if (auto error = jit.addLazyIRModule(
+            llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))) {
+        fmt::print("{}\n", llvm::toString(std::move(error)));
+        return nullptr;
+    }
+    return Lookup(jit);
+}
 
-    return reinterpret_cast<void (*)()>(executionEngine->getFunctionAddress("main"));
-};
+// Number of subroutines in after that aren't in before with the same code
+std::size_t ChangedSubroutines(const ControlFlow& before, const ControlFlow& after) {
+    std::size_t changed = 0;
+    for (const auto& subroutine : after.Functions()) {
+        const auto previous = before.FunctionAt(subroutine.entry);
+        const auto same =
+            previous && previous->instructions == subroutine.instructions &&
+            std::all_of(subroutine.instructions.begin(), subroutine.instructions.end(),
+                        [&](auto address) { return before.Opcode(address) == after.Opcode(address); });
+        changed += !same;
+    }
+    return changed;
+}
 
 void LLVMAOT::Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+    const auto main = Compile(game);
+    if (main)
+        main(&interface, nullptr, GameSeed(interface));
+    else
+        fmt::print("function not found\n");
+}
+
+std::optional<Chip8::Snapshot> LLVMAOT::Save() const {
+    // the generated C++ keeps its state to itself
+    if (!jit || codegen != Codegen::IR)
+        return std::nullopt;
+    const auto save = Lookup<void (*)(Chip8::Snapshot*)>(*jit, "pot8o_save");
+    if (!save)
+        return std::nullopt;
+    Chip8::Snapshot snapshot;
+    save(&snapshot);
+    return snapshot;
+}
+
+void LLVMAOT::Resume(Chip8::Interface& interface, std::vector<std::uint8_t> game,
+                     const Chip8::Snapshot& snapshot) {
+    const auto previous = std::move(compiled);
+    const auto main = Compile(game);
+    if (!main) {
+        fmt::print("function not found\n");
+        return;
+    }
+    if (previous)
+        fmt::print("{} of {} subroutines changed\n", ChangedSubroutines(*previous, *compiled),
+                   compiled->Functions().size());
+    if (CanResume(snapshot)) {
+        fmt::print("resuming at {:#05X}\n", snapshot.program_counter);
+        main(&interface, &snapshot, GameSeed(interface));
+    } else {
+        fmt::print("can't resume at {:#05X}, restarting the game\n", snapshot.program_counter);
+        main(&interface, nullptr, GameSeed(interface));
+    }
+}
+
+bool LLVMAOT::Load(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+    // the generated C++ keeps its state to itself
+    if (codegen != Codegen::IR)
+        return false;
+    start = Compile(game);
+    if (!start)
+        return false;
+    resume = Lookup<int (*)(Chip8::Interface*)>(*jit, "pot8o_continue");
+    if (!resume)
+        return false;
+    loaded = &interface;
+    return true;
+}
+
+bool LLVMAOT::Continue() {
+    if (!loaded)
+        return false;
+    if (start)
+        return std::exchange(start, nullptr)(loaded, nullptr, GameSeed(*loaded)) !=
+               IREmitter::ENDED;
+    return resume(loaded) != IREmitter::ENDED;
+}
+
+LLVMAOT::LLVMAOT(Codegen codegen) : codegen{codegen} {}
+// the JIT goes down with the code it compiled
+LLVMAOT::~LLVMAOT() = default;
+
+bool LLVMAOT::CanResume(const Chip8::Snapshot& snapshot) const {
+    // only reachable instructions have a label, and RET only knows the CALLs it found
+    if (!compiled || !compiled->IsInstruction(snapshot.program_counter) ||
+        snapshot.stack_ptr > snapshot.stack.size())
+        return false;
+    const auto is_call = [&](std::size_t address) {
+        return compiled->Opcode(address) >> 12 == 0x2;
+    };
+    if (codegen == Codegen::Source) {
+        for (std::size_t i = 0; i < snapshot.stack_ptr; i++)
+            if (!compiled->IsInstruction(snapshot.stack[i]) || !is_call(snapshot.stack[i]))
+                return false;
+    } else {
+        // each subroutine only has labels for its own code, so every frame has to be a CALL in
+        // the subroutine the frame below it called into
+        auto function = compiled->FunctionAt(EXECUTION_OFFSET);
+        for (std::size_t i = 0; i < snapshot.stack_ptr; i++) {
+            const auto call = snapshot.stack[i];
+            if (!function->Contains(call) || !is_call(call))
+                return false;
+            function = compiled->FunctionAt(compiled->Opcode(call) & 0x0FFF);
+        }
+        if (!function->Contains(snapshot.program_counter))
+            return false;
+    }
+    // the code was generated from the instructions as they were, data the game wrote into its
+    // own image doesn't matter
+    const auto& instructions = compiled->Instructions();
+    return std::all_of(instructions.begin(), instructions.end(), [&](auto address) {
+        const auto opcode = compiled->Opcode(address);
+        return snapshot.memory[address & 0xFFF] == opcode >> 8 &&
+               snapshot.memory[(address + 1) & 0xFFF] == (opcode & 0xFF);
+    });
+}
+
+void LLVMAOT::Analyze(const std::vector<std::uint8_t>& game) {
+    compiled.emplace(game);
+    profile = Profile::Load(game);
+    if (profile && profile->Empty())
+        profile.reset();
+    if (profile)
+        fmt::print("compiling with the profile of a previous run\n");
+}
+
+LLVMAOT::Entry LLVMAOT::Compile(const std::vector<std::uint8_t>& game) {
+    const auto start = std::chrono::steady_clock::now();
+    Analyze(game);
+    // a fresh session per game, dropping the last one along with all of its code
+    jit.reset();
+    loaded = nullptr;
+    jit = CreateJIT();
+    if (!jit)
+        return nullptr;
+    Entry entry;
+    if (codegen == Codegen::IR) {
+        entry = CompileIR(*jit, *compiled, profile ? &*profile : nullptr);
+    } else {
+        const auto source = GenerateSource(*compiled);
+        entry = CompileSource(*jit, source, CacheKey(AOT_OPS + source));
+    }
+    fmt::print("compiled game in {:.3f} s, {} of {} bytes reachable\n",
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+               compiled->Instructions().size() * 2, game.size());
+    return entry;
+}
+
+bool LLVMAOT::CompileToFile(const std::vector<std::uint8_t>& game, const std::string& path) {
+    InitializeLLVM();
+    Analyze(game);
+    auto context = std::make_unique<llvm::LLVMContext>();
+    std::unique_ptr<llvm::Module> module;
+    if (codegen == Codegen::IR) {
+        module = IREmitter(*context).Emit(*compiled, profile ? &*profile : nullptr);
+        if (llvm::verifyModule(*module, &llvm::errs())) {
+            fmt::print("generated invalid IR\n");
+            return false;
+        }
+    } else {
+        module = CompileToModule(GenerateSource(*compiled), *context);
+        if (!module)
+            return false;
+    }
+    // only the entry is exported so that images loaded side by side each keep to their own code,
+    // which also lets the optimizer inline subroutines that no lazy JIT has to find anymore
+    llvm::internalizeModule(
+        *module, [](const llvm::GlobalValue& value) { return value.getName() == "pot8o_main"; });
+    // tag the image with the game it runs, see Prebuilt
+    const auto tag = llvm::ConstantDataArray::getString(*context, GameHash(game));
+    new llvm::GlobalVariable(*module, tag->getType(), true, llvm::GlobalValue::ExternalLinkage, tag,
+                             "pot8o_game");
+
+    auto targetMachineBuilder = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!targetMachineBuilder) {
+        fmt::print("failed to detect host: {}\n", llvm::toString(targetMachineBuilder.takeError()));
+        return false;
+    }
+    // the image gets loaded at whatever address the dynamic linker picks
+    targetMachineBuilder->setRelocationModel(llvm::Reloc::PIC_);
+    targetMachineBuilder->setCodeGenOptLevel(llvm::CodeGenOpt::Level::Aggressive);
+    auto targetMachine = targetMachineBuilder->createTargetMachine();
+    if (!targetMachine) {
+        fmt::print("failed to create target machine: {}\n",
+                   llvm::toString(targetMachine.takeError()));
+        return false;
+    }
+    module->setDataLayout((*targetMachine)->createDataLayout());
+    module->setTargetTriple((*targetMachine)->getTargetTriple().str());
+    Optimize(*module, targetMachine->get());
+
+    // anything but an object file gets linked into a shared library
+    llvm::SmallVector<char, 0> object;
     {
-        // pass in the interface and a seed for RND
-        source_builder << fmt::format(
-            R"(class Interface;
-Interface& interface = *reinterpret_cast<Interface*>({:p});
-static constexpr unsigned int seed = )" BYTE ";\n",
-            reinterpret_cast<void*>(&interface),
-            std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
-
-        // pass in game data
+        llvm::raw_svector_ostream stream(object);
+        llvm::legacy::PassManager passManager;
+#if LLVM_VERSION_MAJOR >= 10
+        const auto fileType = llvm::CGFT_ObjectFile;
+#else
+        const auto fileType = llvm::TargetMachine::CGFT_ObjectFile;
+#endif
+        if ((*targetMachine)->addPassesToEmitFile(passManager, stream, nullptr, fileType)) {
+            fmt::print("target can't emit object files\n");
+            return false;
+        }
+        passManager.run(*module);
+    }
+    const auto extension = llvm::sys::path::extension(path);
+    const llvm::StringRef contents(object.data(), object.size());
+    if (extension == ".o" || extension == ".obj") {
+        if (!WriteAtomically(path, contents))
+            return false;
+    } else if (!LinkSharedLibrary(contents, path)) {
+        return false;
+    }
+    fmt::print("compiled game to {}\n", path);
+    return true;
+}
+
+std::string LLVMAOT::GenerateSource(const ControlFlow& flow) {
+    this->flow = &flow;
+    const auto& game = flow.Game();
+    source_builder.str({});
+    calls.clear();
+    {
+        // pass in game data, the opcode definitions come from the AOT_OPS prelude
         source_builder << "static constexpr unsigned char game[]{";
         for (auto byte : game)
             source_builder << fmt::format(BYTE ",", byte);
         source_builder << "};";
 
-        // include opcode definitions
-        source_builder << AOT_OPS;
-
         source_builder << R"(
-int main(){
+extern "C" int pot8o_main(Interface* host, const Snapshot* snapshot, unsigned seed) {
     using namespace Opcodes;
-
+    interface = host;
+    budget = host->instruction_budget;
+    rand = seed;
+    u8 V[16]{};
+    unsigned I{};
+    try {
+)";
+        // either pick up where another backend left off or start the game from scratch
+        source_builder << R"(
+    if (snapshot) {
+        Restore(*snapshot, V, I);
+        switch (snapshot->program_counter) {
+)" << Cases(flow.Instructions())
+                       << R"(
+        default:
+            goto end_loop;
+        }
+    }
     for (auto i = 0; i < sizeof(FONT); i++)
 	    memory[i] = FONT[i];
     for (auto i = 0; i < sizeof(game); i++)
 	    memory[0x200 + i] = game[i];
-    try {
 )";
-        // create the jump table
-        source_builder << "static constexpr void* jump_table[]{";
-        for (auto i = 0; i < EXECUTION_OFFSET; i++)
-            source_builder << "nullptr,";
-        for (auto i = EXECUTION_OFFSET; i < game.size() + EXECUTION_OFFSET; i += 2)
-            source_builder << fmt::format("&&l{:3X},nullptr,", i);
-        source_builder << "};\n";
-
-        // generate C++ from game code
-        for (auto pos = game.begin(); pos < game.end(); pos += 2, program_counter += 2) {
-            source_builder << fmt::format("l{:3X}: ", program_counter);
-            opcode = *pos << 8 | *(pos + 1);
+
+        // generate C++ from the reachable game code, which can be odd or skip over data
+        const auto& instructions = flow.Instructions();
+        const auto lengths = ControlFlow::BlockLengths(
+            instructions, [&](std::size_t address) { return flow.Opcode(address); }, {},
+            [&](std::size_t address) { return flow.JumpV0Targets(address); });
+        for (std::size_t i = 0; i < instructions.size(); i++) {
+            program_counter = instructions[i];
+            source_builder << fmt::format("{}: ", Label(program_counter));
+            if (lengths[i])
+                source_builder << fmt::format("cycles += {}; ", lengths[i]);
+            opcode = Peek(program_counter);
             (this->*opcode_table[op()])();
+            if (i + 1 == instructions.size() || instructions[i + 1] != program_counter + 2)
+                source_builder << fmt::format(" goto {};", Label(program_counter + 2));
             source_builder << "\n";
         }
-        source_builder << R"(
+
+        // RET goes back to whichever CALL is on top of the stack
+        source_builder << "return_dispatch:\nswitch (stack[--stack_ptr]) {\n";
+        for (auto call : calls)
+            source_builder << fmt::format("case " ADDR ": goto l" ADDR "_ret;\n", call, call);
+        source_builder << R"(default:
+        goto end_loop;
+    }
     end_loop:
-    for (;;)
-        interface.PushFrame(frame_buffer);
+    PublishCycles();
+    // waiting for ticks paces the loop when throttled and keeps virtual time going
+    while (!interface->Stopping()) {
+        interface->PushFrame(frame_buffer);
+        interface->wait_for_tick(*interface);
+    }
     return 1;
     } catch (...) {
     return 0;
     }
 })";
-
-        std::ofstream source_file("source.cpp", std::ios::out);
-        source_file << source_builder.str();
     }
 
-    const auto main = Compile();
-    if (main)
-        main();
-    else
-        fmt::print("function not found\n");
+    return source_builder.str();
+}
+
+std::string LLVMAOT::Label(std::size_t address) const {
+    if (!flow->IsInstruction(address))
+        return "end_loop";
+    return fmt::format("l{:03X}", address);
+}
+
+std::string LLVMAOT::Hint() const {
+    if (!profile || !profile->executions[program_counter])
+        return "";
+    const auto rate = static_cast<double>(profile->skips[program_counter]) /
+                      profile->executions[program_counter];
+    // __builtin_expect is all or nothing, so only hint the lopsided ones
+    if (rate >= 0.9)
+        return "LIKELY";
+    if (rate <= 0.1)
+        return "UNLIKELY";
+    return "";
+}
+
+std::string LLVMAOT::Cases(const std::vector<std::size_t>& addresses) const {
+    std::string cases;
+    for (auto address : addresses)
+        cases += fmt::format("case " ADDR ": goto {}; ", address, Label(address));
+    return cases;
 }
 
 // TODO: rewrite with function-like macros
 #define c ", "
-#define IMM "_Vx_byte<" REG c BYTE ">();", X(), kk()
-#define REGS "_Vx_Vy<" REG c REG ">();", X(), Y()
-#define ONE_REG "_Vx<" REG ">();", X()
+#define IMM "_Vx_byte<" REG c BYTE ">(V, I);", X(), kk()
+#define REGS "_Vx_Vy<" REG c REG ">(V, I);", X(), Y()
+#define ONE_REG "_Vx<" REG ">(V, I);", X()
 
 void LLVMAOT::NOOP() {}
 
@@ -228,24 +898,29 @@ void LLVMAOT::JP_addr() {
 		// programs often jump to pc when done executing, this ensures that the program still updates the framebuffer
         source_builder << "goto end_loop;";
     else
-        source_builder << fmt::format("JP_addr(" ADDR c ADDR ");", program_counter, nnn());
+        source_builder << fmt::format("JP_addr(" ADDR c ADDR c "{});", program_counter, nnn(),
+                                      Label(nnn()));
 }
 
 void LLVMAOT::CALL_addr() {
-    source_builder << fmt::format("CALL_addr(" ADDR c ADDR ");", program_counter, nnn());
+    calls.push_back(program_counter);
+    source_builder << fmt::format("CALL_addr(" ADDR c ADDR c "{});", program_counter, nnn(),
+                                  Label(nnn()));
 }
 
 void LLVMAOT::SE_Vx_byte() {
-    source_builder << fmt::format("SE_Vx_byte(" ADDR c REG c BYTE ");", program_counter, X(), kk());
+    source_builder << fmt::format("SE_Vx_byte({}" c REG c BYTE c "{});", Label(program_counter + 4),
+                                  X(), kk(), Hint());
 }
 
 void LLVMAOT::SNE_Vx_byte() {
-    source_builder << fmt::format("SNE_Vx_byte(" ADDR c REG c BYTE ");", program_counter, X(),
-                                  kk());
+    source_builder << fmt::format("SNE_Vx_byte({}" c REG c BYTE c "{});",
+                                  Label(program_counter + 4), X(), kk(), Hint());
 }
 
 void LLVMAOT::SE_Vx_Vy() {
-    source_builder << fmt::format("SE_Vx_Vy(" ADDR c REG c REG ");", program_counter, X(), Y());
+    source_builder << fmt::format("SE_Vx_Vy({}" c REG c REG c "{});", Label(program_counter + 4),
+                                  X(), Y(), Hint());
 }
 
 void LLVMAOT::LD_Vx_byte() {
@@ -285,7 +960,7 @@ void LLVMAOT::SUB_Vx_Vy() {
 }
 
 void LLVMAOT::SHR_Vx() {
-    source_builder << fmt::format("SHR_Vx<" REG ">();", X());
+    source_builder << fmt::format("SHR_Vx<" REG ">(V, I);", X());
 }
 
 void LLVMAOT::SUBN_Vx_Vy() {
@@ -293,19 +968,21 @@ void LLVMAOT::SUBN_Vx_Vy() {
 }
 
 void LLVMAOT::SHL_Vx() {
-    source_builder << fmt::format("SHL_Vx<" REG ">();", X());
+    source_builder << fmt::format("SHL_Vx<" REG ">(V, I);", X());
 }
 
 void LLVMAOT::SNE_Vx_Vy() {
-    source_builder << fmt::format("SNE_Vx_Vy(" ADDR c REG c REG ");", program_counter, X(), Y());
+    source_builder << fmt::format("SNE_Vx_Vy({}" c REG c REG c "{});", Label(program_counter + 4),
+                                  X(), Y(), Hint());
 }
 
 void LLVMAOT::LD_I_addr() {
-    source_builder << fmt::format("LD_I_addr<" ADDR ">();", nnn());
+    source_builder << fmt::format("LD_I_addr<" ADDR ">(V, I);", nnn());
 }
 
 void LLVMAOT::JP_V0_addr() {
-    source_builder << fmt::format("JP_V0_addr(" ADDR c ADDR ");", program_counter, nnn());
+    source_builder << fmt::format("JP_V0_addr(" ADDR c ADDR c "{});", program_counter, nnn(),
+                                  Cases(flow->JumpV0Targets(program_counter)));
 }
 
 void LLVMAOT::RND_Vx_byte() {
@@ -313,7 +990,7 @@ void LLVMAOT::RND_Vx_byte() {
 }
 
 void LLVMAOT::DRW_Vx_Vy_nibble() {
-    source_builder << fmt::format("DRW_Vx_Vy_nibble<" REG c REG c BYTE ">();", X(), Y(), n());
+    source_builder << fmt::format("DRW_Vx_Vy_nibble<" REG c REG c BYTE ">(V, I);", X(), Y(), n());
 }
 
 void LLVMAOT::split_E() {
@@ -321,11 +998,13 @@ void LLVMAOT::split_E() {
 }
 
 void LLVMAOT::SKP_Vx() {
-    source_builder << fmt::format("SKP_Vx(" ADDR c REG ");", program_counter, X());
+    source_builder << fmt::format("SKP_Vx({}" c REG c "{});", Label(program_counter + 4), X(),
+                                  Hint());
 }
 
 void LLVMAOT::SKNP_Vx() {
-    source_builder << fmt::format("SKNP_Vx(" ADDR c REG ");", program_counter, X());
+    source_builder << fmt::format("SKNP_Vx({}" c REG c "{});", Label(program_counter + 4), X(),
+                                  Hint());
 }
 
 void LLVMAOT::split_F() {
@@ -333,11 +1012,19 @@ void LLVMAOT::split_F() {
 }
 
 void LLVMAOT::LD_Vx_DT() {
-    source_builder << fmt::format("LD_Vx_DT<" REG ">();", X());
+    // LD Vx, DT; SE/SNE Vx, kk; JP back to the LD only waits for the timer thread
+    const auto skip = Peek(program_counter + 2);
+    if (Peek(program_counter + 4) == (0x1000 | program_counter) && (skip & 0x0F00) >> 8 == X() &&
+        (skip >> 12 == 0x3 || skip >> 12 == 0x4)) {
+        source_builder << fmt::format("LD_Vx_DT_idle<" REG c BYTE c "{}>(V, I);", X(), skip & 0xFF,
+                                      skip >> 12 == 0x3);
+        return;
+    }
+    source_builder << fmt::format("LD_Vx_DT<" REG ">(V, I);", X());
 }
 
 void LLVMAOT::LD_Vx_K() {
-    source_builder << fmt::format("LD_Vx_K<" REG ">();", X());
+    source_builder << fmt::format("if (!LD_Vx_K<" REG ">(V, I))\nreturn 1;", X());
 }
 
 void LLVMAOT::LD_DT_Vx() {
@@ -365,5 +1052,5 @@ void LLVMAOT::LD_I_Vx() {
 }
 
 void LLVMAOT::LD_Vx_I() {
-    source_builder << fmt::format("LD_Vx_I<" REG ">();", X());
+    source_builder << fmt::format("LD_Vx_I<" REG ">(V, I);", X());
 }
\ No newline at end of file
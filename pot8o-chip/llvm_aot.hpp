@@ -1,15 +1,74 @@
+#pragma once
 #include <array>
 #include <cstdint>
+#include <memory>
+#include <optional>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #include "chip8.hpp"
+#include "control_flow.hpp"
+#include "game_image.hpp"
+#include "profile.hpp"
+
+namespace llvm {
+class Module;
+class TargetMachine;
+namespace orc {
+class LLLazyJIT;
+} // namespace orc
+} // namespace llvm
+
+// Set up the native target and the pass registry, shared by every LLVM backend
+void InitializeLLVM();
+// Run the O3 pipeline over module, tuned for targetMachine if there is one
+void Optimize(llvm::Module& module, llvm::TargetMachine* targetMachine = nullptr);
 
 class LLVMAOT final : public Chip8::CPU {
 public:
+    enum class Codegen {
+        // lower opcodes straight to LLVM IR with IREmitter
+        IR,
+        // generate C++ on top of the AOT_OPS prelude and compile it with clang
+        Source,
+    };
+
+    explicit LLVMAOT(Codegen codegen = Codegen::IR);
+    ~LLVMAOT() override;
+
+    using Entry = NativeEntry;
+
     void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+    // Only the IR codegen can hand its state over
+    std::optional<Chip8::Snapshot> Save() const override;
+    // Compile the edited game and continue it from snapshot if it still has code for it
+    // Subroutines the edit left alone come out of the object cache
+    void Resume(Chip8::Interface& interface, std::vector<std::uint8_t> game,
+                const Chip8::Snapshot& snapshot) override;
+    // Only the IR codegen can be stepped, it continues from its state in place
+    bool Load(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+    bool Continue() override;
+
+    // Generate and compile the game without running it, returns nullptr on failure
+    // Compiled objects are cached on disk so loading the same game again skips clang and LLVM
+    // A saved profile of the game steers branch weights and code layout
+    // The entry stays valid until the next Compile, IR subroutines compile on their first CALL
+    Entry Compile(const std::vector<std::uint8_t>& game);
+    // Compile the whole game ahead of time into an object file, or a shared library linked with
+    // the configured linker when path doesn't end in .o, for Prebuilt to load later without LLVM
+    // The image exports pot8o_main with the signature of Entry and pot8o_game, the GameHash of the
+    // game
+    bool CompileToFile(const std::vector<std::uint8_t>& game, const std::string& path);
+    // Whether the code from the last Compile can continue from the snapshot
+    bool CanResume(const Chip8::Snapshot& snapshot) const;
 
 private:
+    // Find the reachable code of the game and pick up the profile of an earlier run
+    void Analyze(const std::vector<std::uint8_t>& game);
+    // Generate C++ for the reachable code of the game on top of the AOT_OPS prelude
+    std::string GenerateSource(const ControlFlow& flow);
+
     void NOOP();
     // Call sub-table for opcodes starting with 0x0
     void split_0();
@@ -117,6 +176,33 @@ private:
         return opcode & 0x0FFF;
     }
 
+    // opcode at address in the game being compiled, 0 past its end
+    inline std::uint16_t Peek(std::size_t address) const {
+        return flow->Opcode(address);
+    }
+
+    // label of the instruction at address, end_loop if it isn't reachable code
+    std::string Label(std::size_t address) const;
+    // LIKELY or UNLIKELY for the skip at program_counter if the profile is sure about it
+    std::string Hint() const;
+    // case labels going to every address in addresses, for a switch over a runtime address
+    std::string Cases(const std::vector<std::size_t>& addresses) const;
+
+    Codegen codegen;
+    // JIT session holding the code of the last Compile
+    std::unique_ptr<llvm::orc::LLLazyJIT> jit;
+    const ControlFlow* flow = nullptr;
+    // the game the last Compile generated code for
+    std::optional<ControlFlow> compiled;
+    // recorded by Interpreter::Dispatch::Profiled on an earlier run of the game
+    std::optional<Profile> profile;
+    // CALLs in the generated source, the return dispatch switches over them
+    std::vector<std::size_t> calls;
+    // what Continue runs, the entry on its first call and pot8o_continue after that
+    Chip8::Interface* loaded = nullptr;
+    Entry start = nullptr;
+    int (*resume)(Chip8::Interface* interface) = nullptr;
+
     // current instruction
     std::uint16_t opcode = 0;
     // location in memory corresponding to the current instruction
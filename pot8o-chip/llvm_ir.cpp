@@ -0,0 +1,918 @@
+#include <algorithm>
+#include <limits>
+
+#include <fmt/format.h>
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
+
+#include "chip8.hpp"
+#include "font.hpp"
+#include "llvm_ir.hpp"
+
+constexpr auto EXECUTION_OFFSET = 0x200;
+
+// alignments became their own type in LLVM 10, a plain unsigned before that
+#if LLVM_VERSION_MAJOR >= 10
+#define ALIGN(bytes) llvm::Align(bytes)
+#else
+#define ALIGN(bytes) bytes
+#endif
+
+std::unique_ptr<llvm::Module> IREmitter::Emit(const ControlFlow& flow, const Profile* profile) {
+    this->flow = &flow;
+    this->profile = profile && !profile->Empty() ? profile : nullptr;
+    code = flow.Game();
+    code_begin = EXECUTION_OFFSET;
+    module = std::make_unique<llvm::Module>("pot8o", context);
+    DeclareState();
+
+    const auto i32 = builder.getInt32Ty();
+    state = new llvm::GlobalVariable(*module, state_type, false, llvm::GlobalValue::InternalLinkage,
+                                     llvm::Constant::getNullValue(state_type), "state");
+    const auto global = [&](const char* name) {
+        return new llvm::GlobalVariable(*module, i32, false, llvm::GlobalValue::InternalLinkage,
+                                        builder.getInt32(0), name);
+    };
+    resume_frame = global("resume_frame");
+    base = global("base");
+
+    // declare every subroutine up front, CALLs can go to ones that are emitted later
+    // they are external so the JIT gives each of them a lazy stub of its own
+    subroutine_type = llvm::FunctionType::get(i32, {interface_type->getPointerTo()}, false);
+    subroutines.clear();
+    for (const auto& subroutine : flow.Functions()) {
+        const auto declared = subroutines[subroutine.entry] = llvm::Function::Create(
+            subroutine_type, llvm::Function::ExternalLinkage,
+            fmt::format("sub_{:03X}", subroutine.entry), module.get());
+        // optimized for size and kept out of the way of the hot code
+        if (this->profile && !this->profile->executions[subroutine.entry])
+            declared->addFnAttr(llvm::Attribute::Cold);
+    }
+    for (const auto& subroutine : flow.Functions())
+        EmitSubroutine(subroutine);
+
+    function = llvm::Function::Create(
+        llvm::FunctionType::get(
+            i32, {interface_type->getPointerTo(), snapshot_type->getPointerTo(), i32}, false),
+        llvm::Function::ExternalLinkage, "pot8o_main", module.get());
+    auto argument = function->arg_begin();
+    interface = &*argument++;
+    llvm::Value* snapshot = &*argument++;
+    llvm::Value* seed = &*argument;
+
+    const auto entry = llvm::BasicBlock::Create(context, "entry", function);
+    const auto run = llvm::BasicBlock::Create(context, "run", function);
+    CreateLabels({});
+
+    builder.SetInsertPoint(entry);
+    BindState(state);
+    builder.CreateStore(seed, rand);
+    builder.CreateStore(builder.getInt32(-1), resume_frame);
+    builder.CreateStore(builder.getInt32(EXECUTION_OFFSET), base);
+    EmitEntry(snapshot, run);
+    EmitRun(run);
+
+    // pick up the state the last pot8o_main or pot8o_continue stopped at as it is, including a
+    // stack rebuilt from a base a Snapshot has no room for
+    function = llvm::Function::Create(subroutine_type, llvm::Function::ExternalLinkage,
+                                      "pot8o_continue", module.get());
+    interface = &*function->arg_begin();
+    const auto resume = llvm::BasicBlock::Create(context, "entry", function);
+    const auto resume_run = llvm::BasicBlock::Create(context, "run", function);
+    CreateLabels({});
+
+    builder.SetInsertPoint(resume);
+    BindState(state);
+    builder.CreateStore(builder.getInt32(0), resume_frame);
+    builder.CreateBr(resume_run);
+    EmitRun(resume_run);
+
+    EmitSave();
+    return std::move(module);
+}
+
+void IREmitter::EmitRun(llvm::BasicBlock* run) {
+    const auto unwound = llvm::BasicBlock::Create(context, "unwound", function);
+    const auto stopped = llvm::BasicBlock::Create(context, "stopped", function);
+    const auto ended = llvm::BasicBlock::Create(context, "ended", function);
+
+    // call the outermost subroutine, again after every time the stack overflowed
+    builder.SetInsertPoint(run);
+    const auto outermost =
+        builder.CreateSwitch(builder.CreateLoad(builder.getInt32Ty(), base), end_loop,
+                             subroutines.size());
+    for (const auto& [address, subroutine] : subroutines) {
+        const auto call =
+            llvm::BasicBlock::Create(context, fmt::format("call_{:03X}", address), function);
+        outermost->addCase(builder.getInt32(address), call);
+        builder.SetInsertPoint(call);
+        const auto status = builder.CreateCall(subroutine_type, subroutine, {interface});
+        // returning from the outermost subroutine ends the game
+        const auto statuses = builder.CreateSwitch(status, end_loop, 3);
+        statuses->addCase(builder.getInt32(UNWOUND), unwound);
+        statuses->addCase(builder.getInt32(STOPPED), stopped);
+        statuses->addCase(builder.getInt32(ENDED), ended);
+    }
+
+    builder.SetInsertPoint(unwound);
+    builder.CreateStore(builder.getInt32(0), resume_frame);
+    builder.CreateBr(run);
+
+    // a subroutine suspended with the state up to date
+    builder.SetInsertPoint(stopped);
+    builder.CreateRet(builder.getInt32(STOPPED));
+
+    // or stopped in the end loop
+    builder.SetInsertPoint(ended);
+    builder.CreateRet(builder.getInt32(ENDED));
+
+    EmitEndLoop();
+}
+
+void IREmitter::EmitSubroutine(const ControlFlow::Function& subroutine) {
+    const auto i32 = builder.getInt32Ty();
+    function = subroutines.at(subroutine.entry);
+    interface = &*function->arg_begin();
+
+    const auto entry = llvm::BasicBlock::Create(context, "entry", function);
+    const auto resuming = llvm::BasicBlock::Create(context, "resuming", function);
+    const auto resume_call = llvm::BasicBlock::Create(context, "resume_call", function);
+    const auto resume_pc = llvm::BasicBlock::Create(context, "resume_pc", function);
+    resume_calls.clear();
+    CreateLabels(subroutine.instructions);
+
+    builder.SetInsertPoint(entry);
+    BindState(state);
+    LocalizeRegisters();
+    const auto frame = builder.CreateLoad(i32, resume_frame);
+    builder.CreateCondBr(builder.CreateICmpSLT(frame, builder.getInt32(0)),
+                         Label(subroutine.entry), resuming);
+
+    // rebuilding the native stack from the CHIP-8 one, every frame below the top is waiting on
+    // the CALL it pushed
+    builder.SetInsertPoint(resuming);
+    builder.CreateCondBr(builder.CreateICmpULT(frame, builder.CreateLoad(i32, stack_ptr)),
+                         resume_call, resume_pc);
+
+    builder.SetInsertPoint(resume_call);
+    builder.CreateStore(builder.CreateAdd(frame, builder.getInt32(1)), resume_frame);
+    const auto calls = builder.CreateSwitch(builder.CreateLoad(i32, StackSlot(frame)), end_loop);
+
+    // and the top one continues at the program counter
+    builder.SetInsertPoint(resume_pc);
+    builder.CreateStore(builder.getInt32(-1), resume_frame);
+    Dispatch(builder.CreateLoad(i32, program_counter_field), subroutine.instructions);
+
+    EmitInstructions(subroutine.instructions);
+    EmitEndLoop();
+
+    for (const auto& [call, label] : resume_calls)
+        calls->addCase(builder.getInt32(call), label);
+}
+
+std::unique_ptr<llvm::Module> IREmitter::EmitBlock(const std::array<std::uint8_t, 0x1000>& memory,
+                                                   const std::vector<std::size_t>& addresses,
+                                                   const std::string& name) {
+    flow = nullptr;
+    profile = nullptr;
+    code = memory;
+    code_begin = 0;
+    module = std::make_unique<llvm::Module>(name, context);
+    DeclareState();
+
+    function = llvm::Function::Create(
+        llvm::FunctionType::get(builder.getVoidTy(),
+                                {interface_type->getPointerTo(), state_type->getPointerTo()},
+                                false),
+        llvm::Function::ExternalLinkage, name, module.get());
+    auto argument = function->arg_begin();
+    interface = &*argument++;
+    llvm::Value* state = &*argument;
+
+    const auto entry = llvm::BasicBlock::Create(context, "entry", function);
+    exits.clear();
+    CreateLabels(addresses);
+
+    builder.SetInsertPoint(entry);
+    BindState(state);
+    LocalizeRegisters();
+    builder.CreateBr(Label(addresses.front()));
+
+    EmitInstructions(addresses);
+    // jumping to itself ends the game, same as in the AOT code
+    EmitEndLoop();
+
+    return std::move(module);
+}
+
+void IREmitter::CreateLabels(const std::vector<std::size_t>& addresses) {
+    labels.assign(0x1000, nullptr);
+    for (auto address : addresses)
+        labels[address] =
+            llvm::BasicBlock::Create(context, fmt::format("l{:03X}", address), function);
+    end_loop = llvm::BasicBlock::Create(context, "end_loop", function);
+}
+
+void IREmitter::EmitInstructions(const std::vector<std::size_t>& addresses) {
+    std::function<std::vector<std::size_t>(std::size_t)> jump_v0_targets;
+    if (flow)
+        jump_v0_targets = [&](std::size_t address) { return flow->JumpV0Targets(address); };
+    const auto lengths = ControlFlow::BlockLengths(
+        addresses, [&](std::size_t address) { return Peek(address); }, {}, jump_v0_targets);
+    for (std::size_t i = 0; i < addresses.size(); i++) {
+        const auto address = addresses[i];
+        program_counter = address;
+        builder.SetInsertPoint(labels[address]);
+        if (lengths[i])
+            CountCycles(lengths[i]);
+        opcode = Peek(program_counter);
+        (this->*opcode_table[op()])();
+        if (!builder.GetInsertBlock()->getTerminator())
+            builder.CreateBr(Label(program_counter + 2));
+    }
+}
+
+void IREmitter::DeclareState() {
+    const auto i8 = builder.getInt8Ty();
+    const auto i32 = builder.getInt32Ty();
+    const auto i64 = builder.getInt64Ty();
+    const auto frame = llvm::ArrayType::get(i64, 32);
+
+    // same layouts as Chip8::Interface and Chip8::Snapshot
+    interface_type = llvm::StructType::create(context, "Interface");
+    wait_for_event_type = llvm::FunctionType::get(
+        builder.getVoidTy(), {interface_type->getPointerTo(), i32}, false);
+    wait_for_key_type =
+        llvm::FunctionType::get(builder.getVoidTy(), {interface_type->getPointerTo()}, false);
+    // wait_for_tick has the same type as wait_for_key
+    interface_type->setBody({frame, i32, i64, i8, i8, i8, i8, i32,
+                             wait_for_event_type->getPointerTo(),
+                             wait_for_key_type->getPointerTo(),
+                             wait_for_key_type->getPointerTo(), i64});
+    snapshot_type = llvm::StructType::create(
+        context,
+        {llvm::ArrayType::get(i8, 0x1000), frame, llvm::ArrayType::get(i8, 16),
+         llvm::ArrayType::get(i32, 16), i32, i32, i32},
+        "Snapshot");
+    state_type = llvm::StructType::create(context, {snapshot_type, i32, i64}, "State");
+}
+
+void IREmitter::BindState(llvm::Value* state) {
+    const auto snapshot = builder.CreateStructGEP(state_type, state, 0);
+    const auto field = [&](unsigned index, const char* name) {
+        return builder.CreateStructGEP(snapshot_type, snapshot, index, name);
+    };
+    memory = field(MEMORY, "memory");
+    frame_buffer = field(FRAME, "frame_buffer");
+    registers = state_registers = field(REGISTERS, "V");
+    stack = field(STACK, "stack");
+    stack_ptr = field(STACK_PTR, "stack_ptr");
+    I = state_I = field(I_REGISTER, "I");
+    program_counter_field = field(PROGRAM_COUNTER, "program_counter");
+    rand = builder.CreateStructGEP(state_type, state, 1, "rand");
+    cycles = state_cycles = builder.CreateStructGEP(state_type, state, 2, "cycles");
+}
+
+void IREmitter::LocalizeRegisters() {
+    registers = builder.CreateAlloca(FieldType(REGISTERS), nullptr, "V.local");
+    I = builder.CreateAlloca(builder.getInt32Ty(), nullptr, "I.local");
+    cycles = builder.CreateAlloca(builder.getInt64Ty(), nullptr, "cycles.local");
+    ReloadRegisters();
+}
+
+void IREmitter::FlushRegisters() {
+    if (registers == state_registers)
+        return;
+    builder.CreateMemCpy(state_registers, ALIGN(1), registers, ALIGN(1), 16);
+    builder.CreateStore(builder.CreateLoad(builder.getInt32Ty(), I), state_I);
+    builder.CreateStore(builder.CreateLoad(builder.getInt64Ty(), cycles), state_cycles);
+}
+
+void IREmitter::ReloadRegisters() {
+    builder.CreateMemCpy(registers, ALIGN(1), state_registers, ALIGN(1), 16);
+    builder.CreateStore(builder.CreateLoad(builder.getInt32Ty(), state_I), I);
+    builder.CreateStore(builder.CreateLoad(builder.getInt64Ty(), state_cycles), cycles);
+}
+
+void IREmitter::EmitEntry(llvm::Value* snapshot, llvm::BasicBlock* run) {
+    const auto start = llvm::BasicBlock::Create(context, "start", function, run);
+    const auto resume = llvm::BasicBlock::Create(context, "resume", function, run);
+    builder.CreateCondBr(builder.CreateIsNull(snapshot), start, resume);
+
+    // start the game from scratch
+    builder.SetInsertPoint(start);
+    std::vector<std::uint8_t> image(0x1000);
+    std::copy(FONT.begin(), FONT.end(), image.begin());
+    std::copy_n(code.begin(), std::min<std::size_t>(code.size(), 0x1000 - EXECUTION_OFFSET),
+                image.begin() + EXECUTION_OFFSET);
+    const auto initial_memory = new llvm::GlobalVariable(
+        *module, FieldType(MEMORY), true, llvm::GlobalValue::PrivateLinkage,
+        llvm::ConstantDataArray::get(context, image), "initial_memory");
+    builder.CreateMemCpy(memory, ALIGN(1), initial_memory, ALIGN(1), image.size());
+    builder.CreateBr(run);
+
+    // pick up where another backend left off
+    builder.SetInsertPoint(resume);
+    const auto field = [&](unsigned index) {
+        return builder.CreateStructGEP(snapshot_type, snapshot, index);
+    };
+    const auto i32 = builder.getInt32Ty();
+    builder.CreateMemCpy(memory, ALIGN(1), field(0), ALIGN(1), 0x1000);
+    builder.CreateMemCpy(frame_buffer, ALIGN(8), field(1), ALIGN(8), 32 * 8);
+    builder.CreateMemCpy(registers, ALIGN(1), field(2), ALIGN(1), 16);
+    // both stacks hold the addresses of the CALLs, the subroutines find their frames from them
+    builder.CreateMemCpy(stack, ALIGN(4), field(3), ALIGN(4), 16 * 4);
+    builder.CreateStore(builder.CreateLoad(i32, field(4)), stack_ptr);
+    builder.CreateStore(builder.CreateLoad(i32, field(5)), I);
+    const auto resume_at = builder.CreateLoad(i32, field(6));
+    builder.CreateStore(resume_at, program_counter_field);
+    builder.CreateStore(builder.getInt32(0), resume_frame);
+    builder.CreateBr(run);
+}
+
+void IREmitter::EmitEndLoop() {
+    // programs often jump to pc when done executing, keep pushing the last frame until stopped
+    builder.SetInsertPoint(end_loop);
+    PushFrame();
+    // paces the loop when throttled and keeps virtual time going
+    builder.CreateCall(wait_for_key_type, LoadConstant(WAIT_FOR_TICK), {interface});
+    const auto exit = llvm::BasicBlock::Create(context, "exit", function);
+    builder.CreateCondBr(Stopping(), exit, end_loop);
+    builder.SetInsertPoint(exit);
+    // the Recompiler publishes the count of its blocks
+    if (flow)
+        PublishCycles();
+    FlushRegisters();
+    if (flow) {
+        // there is no instruction to resume at, the game already ended
+        builder.CreateStore(builder.getInt32(0x1000), program_counter_field);
+        builder.CreateRet(builder.getInt32(ENDED));
+    } else {
+        builder.CreateRetVoid();
+    }
+}
+
+void IREmitter::EmitSave() {
+    function = llvm::Function::Create(
+        llvm::FunctionType::get(builder.getVoidTy(), {snapshot_type->getPointerTo()}, false),
+        llvm::Function::ExternalLinkage, "pot8o_save", module.get());
+    builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", function));
+    builder.CreateMemCpy(&*function->arg_begin(), ALIGN(8),
+                         builder.CreateStructGEP(state_type, state, 0), ALIGN(8),
+                         llvm::ConstantExpr::getSizeOf(snapshot_type));
+    builder.CreateRetVoid();
+}
+
+llvm::BasicBlock* IREmitter::Label(std::size_t address) {
+    if (address < labels.size() && labels[address])
+        return labels[address];
+    if (flow)
+        return end_loop;
+
+    auto& exit = exits[address];
+    if (!exit) {
+        const auto insert_block = builder.GetInsertBlock();
+        const auto insert_point = builder.GetInsertPoint();
+        exit = llvm::BasicBlock::Create(context, fmt::format("exit_{:03X}", address), function);
+        builder.SetInsertPoint(exit);
+        Exit(builder.getInt32(address));
+        builder.SetInsertPoint(insert_block, insert_point);
+    }
+    return exit;
+}
+
+void IREmitter::Exit(llvm::Value* target) {
+    FlushRegisters();
+    builder.CreateStore(target, program_counter_field);
+    builder.CreateRetVoid();
+}
+
+void IREmitter::Suspend() {
+    if (!flow) {
+        Exit(builder.getInt32(program_counter));
+        return;
+    }
+    PublishCycles();
+    FlushRegisters();
+    builder.CreateStore(builder.getInt32(program_counter), program_counter_field);
+    builder.CreateRet(builder.getInt32(STOPPED));
+}
+
+void IREmitter::Jump(std::size_t address) {
+    Safepoint();
+    builder.CreateBr(Label(address));
+}
+
+llvm::SwitchInst* IREmitter::Dispatch(llvm::Value* target,
+                                      const std::vector<std::size_t>& addresses) {
+    if (!flow) {
+        // the Recompiler looks the target up in its own block cache
+        Exit(target);
+        return nullptr;
+    }
+    const auto cases = builder.CreateSwitch(target, end_loop, addresses.size());
+    for (auto address : addresses)
+        cases->addCase(builder.getInt32(address), Label(address));
+    return cases;
+}
+
+void IREmitter::Skip(llvm::Value* condition) {
+    const auto branch =
+        builder.CreateCondBr(condition, Label(program_counter + 4), Label(program_counter + 2));
+    if (!profile || !profile->executions[program_counter])
+        return;
+    const auto skips = profile->skips[program_counter];
+    branch->setMetadata(llvm::LLVMContext::MD_prof,
+                        BranchWeights({skips, profile->executions[program_counter] - skips}));
+}
+
+llvm::MDNode* IREmitter::BranchWeights(std::vector<std::uint64_t> counts) {
+    // weights are 32 bit, only their ratios matter
+    const auto max = *std::max_element(counts.begin(), counts.end());
+    const auto scale = max / std::numeric_limits<std::uint32_t>::max() + 1;
+    std::vector<std::uint32_t> weights;
+    for (auto count : counts)
+        weights.push_back(static_cast<std::uint32_t>(count / scale));
+    return llvm::MDBuilder(context).createBranchWeights(weights);
+}
+
+void IREmitter::CountCycles(std::size_t instructions) {
+    const auto i64 = builder.getInt64Ty();
+    builder.CreateStore(
+        builder.CreateAdd(builder.CreateLoad(i64, cycles), builder.getInt64(instructions)),
+        cycles);
+}
+
+void IREmitter::PublishCycles() {
+    const auto count = builder.CreateLoad(builder.getInt64Ty(), cycles);
+    // the alignment parameter was added in LLVM 13
+#if LLVM_VERSION_MAJOR >= 13
+    builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, InterfaceField(CYCLE_COUNT), count,
+                            llvm::MaybeAlign(), llvm::AtomicOrdering::Monotonic);
+#else
+    builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, InterfaceField(CYCLE_COUNT), count,
+                            llvm::AtomicOrdering::Monotonic);
+#endif
+    builder.CreateStore(builder.getInt64(0), cycles);
+}
+
+void IREmitter::Safepoint() {
+    const auto poll = llvm::BasicBlock::Create(context, "poll", function);
+    const auto done = llvm::BasicBlock::Create(context, "safe", function);
+    const auto branch = builder.CreateCondBr(
+        builder.CreateICmpUGE(builder.CreateLoad(builder.getInt64Ty(), cycles),
+                              LoadConstant(INSTRUCTION_BUDGET)),
+        poll, done);
+    branch->setMetadata(llvm::LLVMContext::MD_prof,
+                        BranchWeights({1, Chip8::Interface::PUBLISH_INTERVAL}));
+
+    builder.SetInsertPoint(poll);
+    PublishCycles();
+    builder.CreateCall(wait_for_key_type, LoadConstant(WAIT_FOR_TICK), {interface});
+    // the Recompiler returns to its dispatcher on every jump, which checks for stops itself
+    if (!flow) {
+        builder.CreateBr(done);
+        builder.SetInsertPoint(done);
+        return;
+    }
+    const auto stop = llvm::BasicBlock::Create(context, "stop", function);
+    builder.CreateCondBr(Stopping(), stop, done);
+
+    // the instruction runs again once resumed, the CPU stopped before any of it took effect
+    builder.SetInsertPoint(stop);
+    Suspend();
+
+    builder.SetInsertPoint(done);
+}
+
+void IREmitter::PushFrame() {
+    const auto copy = llvm::BasicBlock::Create(context, "push_frame", function);
+    const auto done = llvm::BasicBlock::Create(context, "pushed", function);
+    builder.CreateCondBr(builder.CreateIsNotNull(LoadField(SEND_FRAME)), copy, done);
+
+    builder.SetInsertPoint(copy);
+    builder.CreateMemCpy(InterfaceField(FRAME_BUFFER), ALIGN(8), frame_buffer, ALIGN(8), 32 * 8);
+    StoreField(SEND_FRAME, builder.getInt8(false), llvm::AtomicOrdering::Release);
+    builder.CreateBr(done);
+
+    builder.SetInsertPoint(done);
+}
+
+llvm::Value* IREmitter::Stopping() {
+    return builder.CreateIsNotNull(LoadField(STOP_FLAG));
+}
+
+template <typename Ready, typename Wait>
+void IREmitter::WaitUntil(Ready ready, Wait wait) {
+    const auto check = llvm::BasicBlock::Create(context, "check", function);
+    const auto poll = llvm::BasicBlock::Create(context, "poll", function);
+    const auto stop = llvm::BasicBlock::Create(context, "stop", function);
+    const auto park = llvm::BasicBlock::Create(context, "park", function);
+    const auto done = llvm::BasicBlock::Create(context, "done", function);
+    builder.CreateBr(check);
+
+    builder.SetInsertPoint(check);
+    builder.CreateCondBr(ready(), done, poll);
+
+    builder.SetInsertPoint(poll);
+    builder.CreateCondBr(Stopping(), stop, park);
+
+    builder.SetInsertPoint(stop);
+    Suspend();
+
+    // nothing gets counted while parked, so the frontend might as well see the count now
+    builder.SetInsertPoint(park);
+    PublishCycles();
+    wait();
+    builder.CreateBr(check);
+
+    builder.SetInsertPoint(done);
+}
+
+llvm::Value* IREmitter::KeyPressed() {
+    const auto key = builder.CreateAnd(builder.CreateZExt(LoadV(X()), builder.getInt32Ty()), 0xF);
+    return builder.CreateTrunc(builder.CreateLShr(LoadField(KEYPAD_STATE), key),
+                               builder.getInt1Ty());
+}
+
+llvm::Value* IREmitter::LoadV(std::size_t x) {
+    return builder.CreateLoad(
+        builder.getInt8Ty(),
+        builder.CreateConstInBoundsGEP2_32(FieldType(REGISTERS), registers, 0, x));
+}
+
+void IREmitter::StoreV(std::size_t x, llvm::Value* value) {
+    builder.CreateStore(value, builder.CreateConstInBoundsGEP2_32(FieldType(REGISTERS),
+                                                                  registers, 0, x));
+}
+
+llvm::Value* IREmitter::StackSlot(llvm::Value* index) {
+    return builder.CreateInBoundsGEP(FieldType(STACK), stack,
+                                     {builder.getInt32(0), builder.CreateAnd(index, 0xF)});
+}
+
+llvm::Value* IREmitter::Memory(llvm::Value* address) {
+    return builder.CreateInBoundsGEP(
+        FieldType(MEMORY), memory,
+        {builder.getInt32(0), builder.CreateAnd(address, builder.getInt32(0xFFF))});
+}
+
+llvm::Value* IREmitter::InterfaceField(unsigned field) {
+    return builder.CreateStructGEP(interface_type, interface, field);
+}
+
+llvm::Value* IREmitter::LoadField(unsigned field, llvm::AtomicOrdering ordering) {
+    const auto type = interface_type->getElementType(field);
+    const auto load = builder.CreateAlignedLoad(type, InterfaceField(field),
+                                                ALIGN(type->getPrimitiveSizeInBits() / 8));
+    load->setAtomic(ordering);
+    return load;
+}
+
+llvm::Value* IREmitter::LoadConstant(unsigned field) {
+    return builder.CreateLoad(interface_type->getElementType(field), InterfaceField(field));
+}
+
+void IREmitter::StoreField(unsigned field, llvm::Value* value, llvm::AtomicOrdering ordering) {
+    const auto type = interface_type->getElementType(field);
+    const auto store = builder.CreateAlignedStore(value, InterfaceField(field),
+                                                  ALIGN(type->getPrimitiveSizeInBits() / 8));
+    store->setAtomic(ordering);
+}
+
+void IREmitter::NOOP() {}
+
+void IREmitter::split_0() {
+    (this->*opcode_table_0[kk()])();
+}
+
+void IREmitter::CLS() {
+    builder.CreateMemSet(frame_buffer, builder.getInt8(0), 32 * 8, ALIGN(8));
+    PushFrame();
+}
+
+void IREmitter::RET() {
+    Safepoint();
+    const auto pointer =
+        builder.CreateSub(builder.CreateLoad(builder.getInt32Ty(), stack_ptr), builder.getInt32(1));
+    builder.CreateStore(pointer, stack_ptr);
+    if (flow) {
+        // the caller picks up after its CALL
+        FlushRegisters();
+        builder.CreateRet(builder.getInt32(RETURNED));
+        return;
+    }
+    const auto target = builder.CreateAdd(
+        builder.CreateLoad(builder.getInt32Ty(), StackSlot(pointer)), builder.getInt32(2));
+    Exit(target);
+}
+
+void IREmitter::JP_addr() {
+    if (program_counter == nnn())
+        builder.CreateBr(end_loop);
+    else
+        Jump(nnn());
+}
+
+void IREmitter::CALL_addr() {
+    const auto i32 = builder.getInt32Ty();
+    const auto pointer = builder.CreateLoad(i32, stack_ptr);
+    if (!flow) {
+        // a block ends at its CALL, RET comes back to the block starting after it
+        builder.CreateStore(builder.CreateAdd(pointer, builder.getInt32(1)), stack_ptr);
+        builder.CreateStore(builder.getInt32(program_counter), StackSlot(pointer));
+        Jump(nnn());
+        return;
+    }
+
+    Safepoint();
+    const auto overflow = llvm::BasicBlock::Create(context, "overflow", function);
+    const auto push = llvm::BasicBlock::Create(context, "push", function);
+    builder.CreateCondBr(builder.CreateICmpUGE(pointer, builder.getInt32(16)), overflow, push);
+
+    // keep the native stack as deep as the CHIP-8 one by dropping the outermost frame, then
+    // unwind and rebuild it starting from the subroutine that frame called
+    builder.SetInsertPoint(overflow);
+    const auto outermost = builder.CreateLoad(i32, StackSlot(builder.getInt32(0)));
+    const auto byte = [&](unsigned offset) {
+        return builder.CreateZExt(
+            builder.CreateLoad(builder.getInt8Ty(),
+                               Memory(builder.CreateAdd(outermost, builder.getInt32(offset)))),
+            i32);
+    };
+    builder.CreateStore(
+        builder.CreateAnd(builder.CreateOr(builder.CreateShl(byte(0), 8), byte(1)), 0x0FFF), base);
+    builder.CreateMemMove(StackSlot(builder.getInt32(0)), ALIGN(4),
+                          StackSlot(builder.getInt32(1)), ALIGN(4), 15 * 4);
+    builder.CreateStore(builder.getInt32(program_counter), StackSlot(builder.getInt32(15)));
+    builder.CreateStore(builder.getInt32(nnn()), program_counter_field);
+    FlushRegisters();
+    builder.CreateRet(builder.getInt32(UNWOUND));
+
+    builder.SetInsertPoint(push);
+    builder.CreateStore(builder.getInt32(program_counter), StackSlot(pointer));
+    builder.CreateStore(builder.CreateAdd(pointer, builder.getInt32(1)), stack_ptr);
+    const auto call =
+        llvm::BasicBlock::Create(context, fmt::format("l{:03X}_call", program_counter), function);
+    resume_calls.emplace_back(program_counter, call);
+    builder.CreateBr(call);
+
+    // the callee works on the state, so hand it the registers and take them back after
+    builder.SetInsertPoint(call);
+    FlushRegisters();
+    const auto status =
+        builder.CreateCall(subroutine_type, subroutines.at(nnn()), {interface});
+    const auto unwind = llvm::BasicBlock::Create(context, "unwind", function);
+    const auto returned =
+        llvm::BasicBlock::Create(context, fmt::format("l{:03X}_ret", program_counter), function);
+    builder.CreateCondBr(builder.CreateICmpEQ(status, builder.getInt32(RETURNED)), returned,
+                         unwind);
+
+    // the state is already up to date with the subroutine that unwound or stopped
+    builder.SetInsertPoint(unwind);
+    builder.CreateRet(status);
+
+    builder.SetInsertPoint(returned);
+    ReloadRegisters();
+}
+
+void IREmitter::SE_Vx_byte() {
+    Skip(builder.CreateICmpEQ(LoadV(X()), builder.getInt8(kk())));
+}
+
+void IREmitter::SNE_Vx_byte() {
+    Skip(builder.CreateICmpNE(LoadV(X()), builder.getInt8(kk())));
+}
+
+void IREmitter::SE_Vx_Vy() {
+    Skip(builder.CreateICmpEQ(LoadV(X()), LoadV(Y())));
+}
+
+void IREmitter::LD_Vx_byte() {
+    StoreV(X(), builder.getInt8(kk()));
+}
+
+void IREmitter::ADD_Vx_byte() {
+    StoreV(X(), builder.CreateAdd(LoadV(X()), builder.getInt8(kk())));
+}
+
+void IREmitter::split_8() {
+    (this->*opcode_table_8[n()])();
+}
+
+void IREmitter::LD_Vx_Vy() {
+    StoreV(X(), LoadV(Y()));
+}
+
+void IREmitter::OR_Vx_Vy() {
+    StoreV(X(), builder.CreateOr(LoadV(X()), LoadV(Y())));
+}
+
+void IREmitter::AND_Vx_Vy() {
+    StoreV(X(), builder.CreateAnd(LoadV(X()), LoadV(Y())));
+}
+
+void IREmitter::XOR_Vx_Vy() {
+    StoreV(X(), builder.CreateXor(LoadV(X()), LoadV(Y())));
+}
+
+void IREmitter::ADD_Vx_Vy() {
+    const auto x = LoadV(X());
+    const auto sum = builder.CreateAdd(x, LoadV(Y()));
+    // the carry lands in VF first, so the sum wins for ADD VF, Vy
+    StoreV(0xF, builder.CreateZExt(builder.CreateICmpULT(sum, x), builder.getInt8Ty()));
+    StoreV(X(), sum);
+}
+
+void IREmitter::SUB_Vx_Vy() {
+    const auto x = LoadV(X());
+    const auto y = LoadV(Y());
+    StoreV(X(), builder.CreateSub(x, y));
+    StoreV(0xF, builder.CreateZExt(builder.CreateICmpUGE(x, y), builder.getInt8Ty()));
+}
+
+void IREmitter::SHR_Vx() {
+    StoreV(0xF, builder.CreateAnd(LoadV(X()), builder.getInt8(1)));
+    StoreV(X(), builder.CreateLShr(LoadV(X()), builder.getInt8(1)));
+}
+
+void IREmitter::SUBN_Vx_Vy() {
+    const auto x = LoadV(X());
+    const auto y = LoadV(Y());
+    StoreV(X(), builder.CreateSub(y, x));
+    StoreV(0xF, builder.CreateZExt(builder.CreateICmpUGE(y, x), builder.getInt8Ty()));
+}
+
+void IREmitter::SHL_Vx() {
+    StoreV(0xF, builder.CreateLShr(LoadV(X()), builder.getInt8(7)));
+    StoreV(X(), builder.CreateShl(LoadV(X()), builder.getInt8(1)));
+}
+
+void IREmitter::SNE_Vx_Vy() {
+    Skip(builder.CreateICmpNE(LoadV(X()), LoadV(Y())));
+}
+
+void IREmitter::LD_I_addr() {
+    builder.CreateStore(builder.getInt32(nnn()), I);
+}
+
+void IREmitter::JP_V0_addr() {
+    Safepoint();
+    const auto target = builder.CreateAdd(builder.getInt32(nnn()),
+                                          builder.CreateZExt(LoadV(0x0), builder.getInt32Ty()));
+    // only the 256 addresses V0 can reach, not all of memory
+    const auto targets =
+        flow ? flow->JumpV0Targets(program_counter) : std::vector<std::size_t>{};
+    const auto cases = Dispatch(target, targets);
+    if (!cases || !profile || !profile->executions[program_counter])
+        return;
+    // the profile doesn't know where the jumps went, but the targets only run after them
+    std::vector<std::uint64_t> counts{0};
+    for (auto address : targets)
+        counts.push_back(profile->executions[address]);
+    cases->setMetadata(llvm::LLVMContext::MD_prof, BranchWeights(counts));
+}
+
+void IREmitter::RND_Vx_byte() {
+    llvm::Value* value = builder.CreateLoad(builder.getInt32Ty(), rand);
+    value = builder.CreateXor(value, builder.CreateShl(value, 13));
+    value = builder.CreateXor(value, builder.CreateLShr(value, 17));
+    value = builder.CreateXor(value, builder.CreateShl(value, 5));
+    builder.CreateStore(value, rand);
+    StoreV(X(), builder.CreateAnd(builder.CreateTrunc(value, builder.getInt8Ty()),
+                                  builder.getInt8(kk())));
+}
+
+void IREmitter::DRW_Vx_Vy_nibble() {
+    const auto i32 = builder.getInt32Ty();
+    const auto i64 = builder.getInt64Ty();
+    const auto rotate_right =
+        llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::fshr, {i64});
+
+    const auto left = builder.CreateAdd(builder.CreateZExt(LoadV(X()), i64), builder.getInt64(8));
+    const auto top = builder.CreateZExt(LoadV(Y()), i32);
+    const auto address = builder.CreateLoad(i32, I);
+    llvm::Value* flag = builder.getInt64(0);
+
+    for (unsigned row = 0; row < n(); row++) {
+        const auto y = builder.CreateAnd(builder.CreateAdd(top, builder.getInt32(row)), 31);
+        const auto fb_row = builder.CreateInBoundsGEP(FieldType(FRAME), frame_buffer,
+                                                      {builder.getInt32(0), y});
+        const auto sprite = builder.CreateZExt(
+            builder.CreateLoad(builder.getInt8Ty(),
+                               Memory(builder.CreateAdd(address, builder.getInt32(row)))),
+            i64);
+        const auto sprite_row = builder.CreateCall(rotate_right, {sprite, sprite, left});
+        const auto pixels = builder.CreateLoad(i64, fb_row);
+        flag = builder.CreateOr(flag, builder.CreateAnd(pixels, sprite_row));
+        builder.CreateStore(builder.CreateXor(pixels, sprite_row), fb_row);
+    }
+    StoreV(0xF, builder.CreateZExt(builder.CreateIsNotNull(flag), builder.getInt8Ty()));
+
+    PushFrame();
+}
+
+void IREmitter::split_E() {
+    (this->*opcode_table_E[kk()])();
+}
+
+void IREmitter::SKP_Vx() {
+    Skip(KeyPressed());
+}
+
+void IREmitter::SKNP_Vx() {
+    Skip(builder.CreateNot(KeyPressed()));
+}
+
+void IREmitter::split_F() {
+    (this->*opcode_table_F[kk()])();
+}
+
+void IREmitter::LD_Vx_DT() {
+    // LD Vx, DT; SE/SNE Vx, kk; JP back to the LD only waits for the timer thread
+    const auto skip = Peek(program_counter + 2);
+    if (Peek(program_counter + 4) == (0x1000 | program_counter) && (skip & 0x0F00) >> 8 == X() &&
+        (skip >> 12 == 0x3 || skip >> 12 == 0x4)) {
+        const auto equal = skip >> 12 == 0x3;
+        llvm::Value* seen = nullptr;
+        WaitUntil(
+            [&] {
+                seen = LoadField(EVENT_COUNT, llvm::AtomicOrdering::Acquire);
+                const auto timer = LoadField(DELAY_TIMER);
+                StoreV(X(), timer);
+                return equal ? builder.CreateICmpEQ(timer, builder.getInt8(skip & 0xFF))
+                             : builder.CreateICmpNE(timer, builder.getInt8(skip & 0xFF));
+            },
+            [&] {
+                builder.CreateCall(wait_for_event_type, LoadConstant(WAIT_FOR_EVENT),
+                                   {interface, seen});
+            });
+        return;
+    }
+    StoreV(X(), LoadField(DELAY_TIMER));
+}
+
+void IREmitter::LD_Vx_K() {
+    llvm::Value* keys = nullptr;
+    WaitUntil(
+        [&] {
+            keys = LoadField(KEYPAD_STATE);
+            return builder.CreateIsNotNull(keys);
+        },
+        [&] {
+            builder.CreateCall(wait_for_key_type, LoadConstant(WAIT_FOR_KEY), {interface});
+        });
+    const auto count_trailing_zeros = llvm::Intrinsic::getDeclaration(
+        module.get(), llvm::Intrinsic::cttz, {builder.getInt32Ty()});
+    const auto key = builder.CreateCall(count_trailing_zeros, {keys, builder.getTrue()});
+    StoreV(X(), builder.CreateTrunc(key, builder.getInt8Ty()));
+}
+
+void IREmitter::LD_DT_Vx() {
+    StoreField(DELAY_TIMER, LoadV(X()));
+}
+
+void IREmitter::LD_ST_Vx() {
+    StoreField(SOUND_TIMER, LoadV(X()));
+}
+
+void IREmitter::ADD_I_Vx() {
+    builder.CreateStore(
+        builder.CreateAdd(builder.CreateLoad(builder.getInt32Ty(), I),
+                          builder.CreateZExt(LoadV(X()), builder.getInt32Ty())),
+        I);
+}
+
+void IREmitter::LD_F_Vx() {
+    builder.CreateStore(builder.CreateMul(builder.CreateZExt(LoadV(X()), builder.getInt32Ty()),
+                                          builder.getInt32(5)),
+                        I);
+}
+
+void IREmitter::LD_B_Vx() {
+    const auto num = LoadV(X());
+    const auto address = builder.CreateLoad(builder.getInt32Ty(), I);
+    builder.CreateStore(builder.CreateUDiv(num, builder.getInt8(100)), Memory(address));
+    builder.CreateStore(
+        builder.CreateUDiv(builder.CreateURem(num, builder.getInt8(100)), builder.getInt8(10)),
+        Memory(builder.CreateAdd(address, builder.getInt32(1))));
+    builder.CreateStore(builder.CreateURem(num, builder.getInt8(10)),
+                        Memory(builder.CreateAdd(address, builder.getInt32(2))));
+}
+
+void IREmitter::LD_I_Vx() {
+    const auto address = builder.CreateLoad(builder.getInt32Ty(), I);
+    for (unsigned i = 0; i <= X(); i++)
+        builder.CreateStore(LoadV(i), Memory(builder.CreateAdd(address, builder.getInt32(i))));
+}
+
+void IREmitter::LD_Vx_I() {
+    const auto address = builder.CreateLoad(builder.getInt32Ty(), I);
+    for (unsigned i = 0; i <= X(); i++)
+        StoreV(i, builder.CreateLoad(builder.getInt8Ty(),
+                                     Memory(builder.CreateAdd(address, builder.getInt32(i)))));
+}
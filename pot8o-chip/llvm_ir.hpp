@@ -0,0 +1,390 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include "control_flow.hpp"
+#include "profile.hpp"
+
+// Lowers a game straight to LLVM IR with the same semantics as the Opcodes in aot_ops.hpp, so
+// LLVMAOT can skip generating C++ and running clang over it
+// Also lowers single blocks of code for Recompiler
+class IREmitter {
+public:
+    explicit IREmitter(llvm::LLVMContext& context) : context{context}, builder{context} {}
+
+    // Build a module defining pot8o_main for the game, with the signature of LLVMAOT::Entry
+    // Only the instructions flow found reachable get lowered, each subroutine into a function of
+    // its own so a lazy JIT can compile them the first time they get called
+    // With a profile, skips and JP V0 get branch weights and subroutines that never ran are cold
+    // pot8o_save(Snapshot*) copies out the state pot8o_main stopped at, resuming a waiting game
+    // from it runs the instruction it waited in again
+    // pot8o_continue(Interface*) carries on from that state in place, without a Snapshot
+    // Both return STOPPED when stopped in the middle of the game and ENDED in the end loop
+    std::unique_ptr<llvm::Module> Emit(const ControlFlow& flow, const Profile* profile = nullptr);
+    // Build a module defining name as a Recompiler::Block for the instructions at addresses in
+    // memory, control leaving them is written back to the program counter in the state
+    std::unique_ptr<llvm::Module> EmitBlock(const std::array<std::uint8_t, 0x1000>& memory,
+                                            const std::vector<std::size_t>& addresses,
+                                            const std::string& name);
+
+    // what a subroutine returns to its caller
+    enum Status {
+        // RET, continue after the CALL
+        RETURNED,
+        // the host stopped the CPU, same as pot8o_main returning 1
+        STOPPED,
+        // the stack overflowed, return all the way to pot8o_main and restart from base
+        UNWOUND,
+        // the host stopped the CPU after the game ended
+        ENDED,
+    };
+
+private:
+    void NOOP();
+    // Call sub-table for opcodes starting with 0x0
+    void split_0();
+    // Clear the display
+    void CLS();
+    // Return from a subroutine
+    void RET();
+
+    // Jump to location nnn
+    void JP_addr();
+    // Call subroutine at nnn
+    void CALL_addr();
+    // Skip next instruction if V[x] == kk
+    void SE_Vx_byte();
+    // Skip next instruction if V[x] != kk
+    void SNE_Vx_byte();
+    // Skip next instruction if V[x] == V[y]
+    void SE_Vx_Vy();
+    // Set V[x] to kk
+    void LD_Vx_byte();
+    // Set V[x] to V[x] + kk
+    void ADD_Vx_byte();
+
+    // Call sub-table for opcodes starting with 0x8
+    void split_8();
+    // Set V[x] to V[y]
+    void LD_Vx_Vy();
+    // Set V[x] to V[x] | V[y]
+    void OR_Vx_Vy();
+    // Set V[x] to V[x] & V[y]
+    void AND_Vx_Vy();
+    // Set V[x] to V[x] ^ V[y]
+    void XOR_Vx_Vy();
+    // Set V[x] to V[x] + V[y]
+    void ADD_Vx_Vy();
+    // Set V[x] to V[x] - V[y]
+    void SUB_Vx_Vy();
+    // Set V[x] to V[x] >> V[y]
+    void SHR_Vx();
+    // Set V[x] to V[y] - V[x]
+    void SUBN_Vx_Vy();
+    // Set V[x] to V[x] << V[y]
+    void SHL_Vx();
+
+    // Skip next instruction if V[x] != V[y]
+    void SNE_Vx_Vy();
+    // Set I to nnn
+    void LD_I_addr();
+    // Jump to nnn + V[0]
+    void JP_V0_addr();
+    // V[x] = random byte & kk
+    void RND_Vx_byte();
+    // Display n-byte sprite starting at memory location I at (V[x], V[y]), set VF = collision
+    void DRW_Vx_Vy_nibble();
+
+    // Call sub-table for opcodes starting with 0xE
+    void split_E();
+    // Skip next instruction if key with the value of V[x] is pressed
+    void SKP_Vx();
+    // Skip next instruction if key with the value of V[x] is not pressed
+    void SKNP_Vx();
+
+    // Call sub-table for opcodes starting with 0xF
+    void split_F();
+    // Set V[x] to DT
+    void LD_Vx_DT();
+    // Wait for a key press, store the value of the key in V[x]
+    void LD_Vx_K();
+    // Set DT to V[x]
+    void LD_DT_Vx();
+    // Set ST to V[x]
+    void LD_ST_Vx();
+    // Set I to I + V[x]
+    void ADD_I_Vx();
+    // Set I to address of sprite for digit Vx
+    void LD_F_Vx();
+    // Store BCD representation of V[x] in memory locations I, I+1, and I+2
+    void LD_B_Vx();
+    // Store registers V[0] through V[x] in memory starting at location I
+    void LD_I_Vx();
+    // Read registers V[0] through V[x] from memory starting at location I
+    void LD_Vx_I();
+
+    void DeclareState();
+    // point the machine state members at the fields of state
+    void BindState(llvm::Value* state);
+    // Keep V, I and the cycle count in locals of the function being lowered, where LLVM can
+    // promote them to SSA values, and load them from the state
+    // They only need to go back to the state when another function gets to see it, CALLs and
+    // leaving the function, nothing else reads them
+    void LocalizeRegisters();
+    // store the locals back into the state
+    void FlushRegisters();
+    // load the locals from the state, after a CALL changed it
+    void ReloadRegisters();
+    // create a block for each instruction and the end loop
+    void CreateLabels(const std::vector<std::size_t>& addresses);
+    void EmitInstructions(const std::vector<std::size_t>& addresses);
+    // Lower the function into its subroutine, which starts at its entry or resumes the frame the
+    // resume_frame global points at
+    void EmitSubroutine(const ControlFlow::Function& subroutine);
+    // Restore a Snapshot or load the game into memory, then continue at run
+    void EmitEntry(llvm::Value* snapshot, llvm::BasicBlock* run);
+    // Call the outermost subroutine from run and return what stopped it
+    void EmitRun(llvm::BasicBlock* run);
+    void EmitEndLoop();
+    // Define pot8o_save, copying the state into the Snapshot it is passed
+    void EmitSave();
+
+    // block holding the instruction at address
+    // the end loop if it isn't reachable code, or a block exiting to it when lowering a block
+    llvm::BasicBlock* Label(std::size_t address);
+    // leave a block, continuing at the program counter in target
+    void Exit(llvm::Value* target);
+    // stop at the current instruction with the state up to date, for the host to pick up later
+    void Suspend();
+    // jump to address through a safepoint
+    void Jump(std::size_t address);
+    // switch from the runtime address in target to the blocks of addresses, anything else ends
+    // up in the end loop
+    // returns the switch, or nullptr when lowering a block and the target leaves it instead
+    llvm::SwitchInst* Dispatch(llvm::Value* target, const std::vector<std::size_t>& addresses);
+    // continue at pc + 4 if condition holds, otherwise at pc + 2
+    void Skip(llvm::Value* condition);
+    // !prof metadata for the counts of each successor, scaled down to fit
+    llvm::MDNode* BranchWeights(std::vector<std::uint64_t> counts);
+    // count the instructions in the block starting at the current instruction
+    void CountCycles(std::size_t instructions);
+    // add the counted instructions to the cycle count of the interface
+    void PublishCycles();
+    // once the instruction budget of the interface is used up, publish the cycles, call
+    // wait_for_tick and in the generated subroutines also suspend at the current instruction if
+    // the host stopped the CPU
+    // emitted at every jump, CALL and RET, which every loop goes through, so stops and throttling
+    // take effect within a budget of instructions while the common path only compares the counter
+    void Safepoint();
+    void PushFrame();
+
+    // true once the host asked the CPU to stop
+    llvm::Value* Stopping();
+    // whether the key in V[x] is held down
+    llvm::Value* KeyPressed();
+    // wait loop that calls wait(interface, ...) until ready returns true, emits into the current
+    // block and continues after the loop
+    // Suspends at the current instruction if the host stops the CPU during the wait
+    template <typename Ready, typename Wait>
+    void WaitUntil(Ready ready, Wait wait);
+
+    llvm::Value* LoadV(std::size_t x);
+    void StoreV(std::size_t x, llvm::Value* value);
+    // pointer to stack[index & 0xF]
+    llvm::Value* StackSlot(llvm::Value* index);
+    // pointer to memory[address & 0xFFF]
+    llvm::Value* Memory(llvm::Value* address);
+    llvm::Type* FieldType(unsigned field) const {
+        return snapshot_type->getElementType(field);
+    }
+    llvm::Value* InterfaceField(unsigned field);
+    // fields the timer and frontend threads touch are accessed atomically, like in aot_ops.hpp
+    llvm::Value* LoadField(unsigned field,
+                           llvm::AtomicOrdering ordering = llvm::AtomicOrdering::Monotonic);
+    // fields that never change while the CPU runs, the wait_for_* function pointers and
+    // instruction_budget
+    llvm::Value* LoadConstant(unsigned field);
+    void StoreField(unsigned field, llvm::Value* value,
+                    llvm::AtomicOrdering ordering = llvm::AtomicOrdering::Monotonic);
+
+    inline std::uint8_t op() {
+        return (opcode & 0xF000) >> 12;
+    }
+
+    inline std::uint8_t X() {
+        return (opcode & 0x0F00) >> 8;
+    }
+
+    inline std::uint8_t Y() {
+        return (opcode & 0x00F0) >> 4;
+    }
+
+    inline std::uint8_t n() {
+        return opcode & 0x000F;
+    }
+
+    inline std::uint8_t kk() {
+        return opcode & 0x00FF;
+    }
+
+    inline std::size_t nnn() {
+        return opcode & 0x0FFF;
+    }
+
+    // opcode at address in the code being compiled, 0 outside of it
+    inline std::uint16_t Peek(std::size_t address) const {
+        const auto offset = address - code_begin;
+        if (address < code_begin || offset + 1 >= code.size())
+            return 0;
+        return code[offset] << 8 | code[offset + 1];
+    }
+
+    // fields of Interface, in the same order as Chip8::Interface
+    enum InterfaceFields {
+        FRAME_BUFFER,
+        KEYPAD_STATE,
+        CYCLE_COUNT,
+        DELAY_TIMER,
+        SOUND_TIMER,
+        SEND_FRAME,
+        STOP_FLAG,
+        EVENT_COUNT,
+        WAIT_FOR_EVENT,
+        WAIT_FOR_KEY,
+        WAIT_FOR_TICK,
+        INSTRUCTION_BUDGET,
+    };
+
+    // fields of Snapshot, in the same order as Chip8::Snapshot
+    enum SnapshotFields {
+        MEMORY,
+        FRAME,
+        REGISTERS,
+        STACK,
+        STACK_PTR,
+        I_REGISTER,
+        PROGRAM_COUNTER,
+    };
+
+
+    llvm::LLVMContext& context;
+    llvm::IRBuilder<> builder;
+    std::unique_ptr<llvm::Module> module;
+    // the game, or all of memory when lowering a block
+    llvm::ArrayRef<std::uint8_t> code;
+    std::size_t code_begin = 0x200;
+    // null when lowering a block
+    const ControlFlow* flow = nullptr;
+    // null without a profile for the game
+    const Profile* profile = nullptr;
+
+    llvm::StructType* interface_type = nullptr;
+    llvm::StructType* snapshot_type = nullptr;
+    // a Snapshot followed by rand and cycles, same layout as Recompiler::State
+    llvm::StructType* state_type = nullptr;
+    llvm::FunctionType* wait_for_event_type = nullptr;
+    llvm::FunctionType* wait_for_key_type = nullptr;
+
+    // the same machine state as the globals in aot_ops.hpp, fields of a global State for a game
+    // and of the State passed in for a block
+    // registers and I point at locals instead inside subroutines and blocks
+    llvm::Value* memory = nullptr;
+    llvm::Value* frame_buffer = nullptr;
+    llvm::Value* registers = nullptr;
+    // addresses of the CALLs waiting to be returned to, like Snapshot::stack
+    llvm::Value* stack = nullptr;
+    llvm::Value* stack_ptr = nullptr;
+    llvm::Value* I = nullptr;
+    llvm::Value* program_counter_field = nullptr;
+    // where registers and I live in the state, when they are locals
+    llvm::Value* state_registers = nullptr;
+    llvm::Value* state_I = nullptr;
+    llvm::Value* rand = nullptr;
+    // instructions run and not published to the interface yet, a local like registers and I
+    llvm::Value* cycles = nullptr;
+    llvm::Value* state_cycles = nullptr;
+
+    // the global State of a game
+    llvm::GlobalVariable* state = nullptr;
+    // index of the next stack entry to rebuild a native frame for, -1 when not resuming
+    llvm::Value* resume_frame = nullptr;
+    // entry of the subroutine pot8o_main calls
+    llvm::Value* base = nullptr;
+    llvm::FunctionType* subroutine_type = nullptr;
+    // a function for each of the functions of flow, by entry
+    std::map<std::size_t, llvm::Function*> subroutines;
+
+    // function being lowered
+    llvm::Function* function = nullptr;
+    llvm::Value* interface = nullptr;
+    // one block per reachable instruction, indexed by address, null everywhere else
+    std::vector<llvm::BasicBlock*> labels;
+    // blocks leaving the block being lowered for each address outside of it
+    std::map<std::size_t, llvm::BasicBlock*> exits;
+    // blocks calling into the subroutine of each CALL in the function, by address of the CALL
+    std::vector<std::pair<std::size_t, llvm::BasicBlock*>> resume_calls;
+    llvm::BasicBlock* end_loop = nullptr;
+
+    // current instruction
+    std::uint16_t opcode = 0;
+    // location in memory corresponding to the current instruction
+    std::size_t program_counter = 0x200;
+
+    using Instruction = decltype(&IREmitter::NOOP);
+
+    // clang-format off
+	static constexpr std::array<Instruction, 0x10> opcode_table{
+		&IREmitter::split_0,		&IREmitter::JP_addr,			&IREmitter::CALL_addr,	&IREmitter::SE_Vx_byte,
+		&IREmitter::SNE_Vx_byte,	&IREmitter::SE_Vx_Vy,			&IREmitter::LD_Vx_byte,	&IREmitter::ADD_Vx_byte,
+		&IREmitter::split_8,		&IREmitter::SNE_Vx_Vy,			&IREmitter::LD_I_addr,	&IREmitter::JP_V0_addr,
+		&IREmitter::RND_Vx_byte,	&IREmitter::DRW_Vx_Vy_nibble,	&IREmitter::split_E,	&IREmitter::split_F
+	};
+
+	static constexpr std::array<Instruction, 0x100> opcode_table_0 = []() constexpr {
+		std::array<Instruction, 0x100> table{};
+		for (auto& op : table) op = &IREmitter::NOOP;
+		table[0xE0] = &IREmitter::CLS;
+		table[0xEE] = &IREmitter::RET;
+		return table;
+	}();
+
+	static constexpr std::array<Instruction, 0x10> opcode_table_8 {
+		&IREmitter::LD_Vx_Vy,	&IREmitter::OR_Vx_Vy,	&IREmitter::AND_Vx_Vy,	&IREmitter::XOR_Vx_Vy,
+		&IREmitter::ADD_Vx_Vy,	&IREmitter::SUB_Vx_Vy,	&IREmitter::SHR_Vx,		&IREmitter::SUBN_Vx_Vy,
+		&IREmitter::NOOP,		&IREmitter::NOOP,		&IREmitter::NOOP,		&IREmitter::NOOP,
+		&IREmitter::NOOP,		&IREmitter::NOOP,		&IREmitter::SHL_Vx,		&IREmitter::NOOP
+	};
+
+	static constexpr std::array<Instruction, 0x100> opcode_table_E = []() constexpr {
+		std::array<Instruction, 0x100> table{};
+		for (auto& op : table) op = &IREmitter::NOOP;
+		table[0x9E] = &IREmitter::SKP_Vx;
+		table[0xA1] = &IREmitter::SKNP_Vx;
+		return table;
+	}();
+
+	static constexpr std::array<Instruction, 0x100> opcode_table_F = []() constexpr {
+		std::array<Instruction, 0x100> table{};
+		for (auto& op : table) op = &IREmitter::NOOP;
+		table[0x07] = &IREmitter::LD_Vx_DT;
+		table[0x0A] = &IREmitter::LD_Vx_K;
+		table[0x15] = &IREmitter::LD_DT_Vx;
+		table[0x18] = &IREmitter::LD_ST_Vx;
+		table[0x1E] = &IREmitter::ADD_I_Vx;
+		table[0x29] = &IREmitter::LD_F_Vx;
+		table[0x33] = &IREmitter::LD_B_Vx;
+		table[0x55] = &IREmitter::LD_I_Vx;
+		table[0x65] = &IREmitter::LD_Vx_I;
+		return table;
+	}();
+    // clang-format on
+};
@@ -1,20 +1,73 @@
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <string>
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
 
+#include "cpus.hpp"
 #include "frontend.hpp"
+#include "llvm_aot.hpp"
+#include "options.hpp"
+#include "tiered.hpp"
+
+static int Usage(const std::string& arg) {
+    std::cout << "bad option: " << arg << '\n'
+              << "usage: pot8o-chip [--cpu=NAME] [--watch] [--instructions-per-tick=N] "
+                 "[--compile=IMAGE] [GAME]\n";
+    return 1;
+}
 
 int main(int argc, char* argv[]) {
     // get path from CLI otherwise wait for input
     std::string path;
-    if (argc <= 1) {
+    std::unique_ptr<Chip8::CPU> cpu;
+    // compile the game to this image instead of running it
+    std::string image;
+    auto codegen = LLVMAOT::Codegen::IR;
+    bool watch = false;
+    std::uint64_t instructions_per_tick = 0;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.rfind("--cpu=", 0) == 0) {
+            const auto name = arg.substr(std::strlen("--cpu="));
+            cpu = MakeCPU(name);
+            if (!cpu) {
+                std::cout << "unknown cpu: " << name << '\n';
+                return 1;
+            }
+            if (name == "aot-clang")
+                codegen = LLVMAOT::Codegen::Source;
+        } else if (arg == "--watch")
+            watch = true;
+        else if (arg.rfind("--instructions-per-tick=", 0) == 0) {
+            if (!ParseNumber(arg, "--instructions-per-tick=", instructions_per_tick))
+                return Usage(arg);
+        } else if (arg.rfind("--compile=", 0) == 0)
+            image = arg.substr(std::strlen("--compile="));
+        else
+            path = arg;
+    }
+    if (!cpu)
+        cpu = std::make_unique<Tiered>();
+    if (path.empty()) {
         std::cin >> path;
-    } else {
-        path = argv[1];
     }
 
-    SDLFrontend frontend;
+    if (!image.empty()) {
+        std::ifstream game(path, std::ios::binary);
+        if (!game) {
+            std::cout << "bad game path: " << path << '\n';
+            return 1;
+        }
+        const std::vector<std::uint8_t> bytes{std::istreambuf_iterator<char>(game),
+                                              std::istreambuf_iterator<char>()};
+        return LLVMAOT(codegen).CompileToFile(bytes, image) ? 0 : 1;
+    }
+
+    SDLFrontend frontend(std::move(cpu), watch, instructions_per_tick);
     while (true) {
         frontend.LoadGame(path);
         std::cin >> path;
@@ -0,0 +1,13 @@
+#pragma once
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+// The whole rest of arg after prefix as a number, false if it isn't one or doesn't fit
+template <typename T> bool ParseNumber(const std::string& arg, const char* prefix, T& value) {
+    const auto begin = arg.data() + std::strlen(prefix);
+    const auto end = arg.data() + arg.size();
+    const auto [last, error] = std::from_chars(begin, end, value);
+    return begin != end && last == end && error == std::errc();
+}
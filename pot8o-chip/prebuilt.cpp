@@ -0,0 +1,47 @@
+#include <mutex>
+#include <set>
+
+#include <fmt/format.h>
+
+#include <llvm/Support/DynamicLibrary.h>
+
+#include "game_image.hpp"
+#include "prebuilt.hpp"
+
+namespace {
+// the machine state lives in the image, so a library can only run one game at a time
+std::mutex running_mutex;
+std::set<const void*> running;
+} // namespace
+
+void Prebuilt::Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+    // dlopen or LoadLibrary, loading the same image again hands back the same library
+    std::string error;
+    auto library = llvm::sys::DynamicLibrary::getPermanentLibrary(image.c_str(), &error);
+    if (!library.isValid()) {
+        fmt::print("failed to load {}: {}\n", image, error);
+        return;
+    }
+    const auto tag = static_cast<const char*>(library.getAddressOfSymbol("pot8o_game"));
+    const auto main = reinterpret_cast<NativeEntry>(library.getAddressOfSymbol("pot8o_main"));
+    if (!tag || !main) {
+        fmt::print("{} is not a compiled game\n", image);
+        return;
+    }
+    if (tag != GameHash(game)) {
+        fmt::print("{} was compiled from a different game\n", image);
+        return;
+    }
+
+    // the tag tells the loaded libraries apart, each of them has one of its own
+    {
+        std::lock_guard lock{running_mutex};
+        if (!running.insert(tag).second) {
+            fmt::print("{} is already running a game\n", image);
+            return;
+        }
+    }
+    main(&interface, nullptr, GameSeed(interface));
+    std::lock_guard lock{running_mutex};
+    running.erase(tag);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "chip8.hpp"
+
+// Runs games from an image LLVMAOT::CompileToFile built ahead of time, so loading a game never
+// starts clang or LLVM
+// The image stays loaded for the rest of the process and only runs the game it was built from
+// Every Prebuilt of one image shares its machine state, so only one of them runs at a time, Run
+// returns right away while another one is running
+class Prebuilt final : public Chip8::CPU {
+public:
+    explicit Prebuilt(std::string image) : image{std::move(image)} {}
+
+    void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+
+private:
+    std::string image;
+};
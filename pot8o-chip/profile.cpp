@@ -0,0 +1,56 @@
+#include <algorithm>
+#include <fstream>
+
+#include <fmt/format.h>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+
+#include "profile.hpp"
+
+static std::string PathOf(const std::vector<std::uint8_t>& game) {
+    llvm::SmallString<128> path;
+    if (llvm::sys::path::cache_directory(path))
+        llvm::sys::path::append(path, "pot8o-chip", "profiles");
+    else
+        path = "profiles";
+    llvm::sys::fs::create_directories(path);
+
+    llvm::SHA1 hasher;
+    hasher.update(llvm::ArrayRef<std::uint8_t>(game));
+    llvm::sys::path::append(path, llvm::toHex(hasher.final(), true) + ".profile");
+    return path.str().str();
+}
+
+bool Profile::Empty() const {
+    return std::all_of(executions.begin(), executions.end(), [](auto count) { return !count; });
+}
+
+std::optional<Profile> Profile::Load(const std::vector<std::uint8_t>& game) {
+    std::ifstream file(PathOf(game), std::ios::binary);
+    if (!file)
+        return std::nullopt;
+    Profile profile;
+    file.read(reinterpret_cast<char*>(profile.executions.data()), sizeof(profile.executions));
+    file.read(reinterpret_cast<char*>(profile.skips.data()), sizeof(profile.skips));
+    if (!file) {
+        fmt::print("ignoring truncated profile\n");
+        return std::nullopt;
+    }
+    return profile;
+}
+
+void Profile::Save(const std::vector<std::uint8_t>& game) const {
+    const auto path = PathOf(game);
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(executions.data()), sizeof(executions));
+    file.write(reinterpret_cast<const char*>(skips.data()), sizeof(skips));
+    if (!file)
+        fmt::print("failed to save profile to {}\n", path);
+    else
+        fmt::print("saved profile to {}\n", path);
+}
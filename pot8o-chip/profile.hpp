@@ -0,0 +1,26 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// How often each instruction of a game ran, recorded by the Interpreter so LLVMAOT can weight
+// branches and lay out cold code out of the way
+struct Profile {
+    // times the instruction at each address ran
+    std::array<std::uint64_t, 0x1000> executions{};
+    // times control continued at address + 4 afterwards, for skips the times they skipped
+    std::array<std::uint64_t, 0x1000> skips{};
+
+    void Record(std::size_t address, std::size_t next) {
+        executions[address & 0xFFF]++;
+        if (next == address + 4)
+            skips[address & 0xFFF]++;
+    }
+
+    bool Empty() const;
+
+    // Profiles live in the user cache directory, named after a hash of the game
+    static std::optional<Profile> Load(const std::vector<std::uint8_t>& game);
+    void Save(const std::vector<std::uint8_t>& game) const;
+};
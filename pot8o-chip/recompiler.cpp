@@ -0,0 +1,187 @@
+#include <algorithm>
+
+#include <fmt/format.h>
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "font.hpp"
+#include "llvm_aot.hpp"
+#include "llvm_ir.hpp"
+#include "recompiler.hpp"
+
+// bytes written at I by the instruction, which might overwrite compiled code
+static std::size_t StoreLength(std::uint16_t opcode) {
+    switch (opcode & 0xF0FF) {
+    case 0xF033:
+        return 3;
+    case 0xF055:
+        return ((opcode & 0x0F00) >> 8) + 1;
+    default:
+        return 0;
+    }
+}
+
+// whether control leaves the block after the instruction, skips stay inside of it
+static bool Branches(std::uint16_t opcode) {
+    switch (opcode >> 12) {
+    case 0x0:
+        return opcode == 0x00EE;
+    case 0x1:
+    case 0x2:
+    case 0xB:
+        return true;
+    default:
+        return false;
+    }
+}
+
+Recompiler::Recompiler() = default;
+Recompiler::~Recompiler() = default;
+
+void Recompiler::Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+    InitializeLLVM();
+    // blocks have to go before the JIT their code is in
+    for (auto& block : blocks)
+        block.reset();
+    compiled_code.reset();
+    compiled_blocks = invalidated_blocks = 0;
+    jit.reset();
+
+    auto targetMachineBuilder = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!targetMachineBuilder) {
+        fmt::print("failed to detect host: {}\n", llvm::toString(targetMachineBuilder.takeError()));
+        return;
+    }
+    targetMachineBuilder->setCodeGenOptLevel(llvm::CodeGenOpt::Level::Aggressive);
+    auto targetMachine = targetMachineBuilder->createTargetMachine();
+    if (!targetMachine) {
+        fmt::print("failed to create target machine: {}\n",
+                   llvm::toString(targetMachine.takeError()));
+        return;
+    }
+    target_machine = std::move(*targetMachine);
+    auto created =
+        llvm::orc::LLJITBuilder().setJITTargetMachineBuilder(*targetMachineBuilder).create();
+    if (!created) {
+        fmt::print("failed to create JIT: {}\n", llvm::toString(created.takeError()));
+        return;
+    }
+    jit = std::move(*created);
+    // generated code calls memcpy and friends
+    jit->getMainJITDylib().addGenerator(
+        llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            jit->getDataLayout().getGlobalPrefix())));
+
+    state = {};
+    auto& machine = state.machine;
+    std::copy(FONT.begin(), FONT.end(), machine.memory.begin());
+    std::copy_n(game.begin(), std::min<std::size_t>(game.size(), 0x1000 - 0x200),
+                machine.memory.begin() + 0x200);
+    machine.program_counter = 0x200;
+    state.rand = GameSeed(interface);
+
+    while (machine.program_counter < 0x1000 &&
+           !interface.stop_flag.load(std::memory_order_relaxed)) {
+        const auto block =
+            blocks[machine.program_counter] ? blocks[machine.program_counter].get()
+                                            : Compile(machine.program_counter);
+        if (!block)
+            break;
+        const auto store_length = block->store_length;
+        block->entry(&interface, &state);
+        // the store was the last instruction, so the block isn't running anymore if it wrote to
+        // itself
+        if (store_length)
+            Invalidate(machine.I, store_length);
+    }
+    interface.cycle_count += state.cycles;
+
+    fmt::print("{} blocks compiled, {} invalidated by stores into code\n", compiled_blocks,
+               invalidated_blocks);
+}
+
+Recompiler::Block* Recompiler::Compile(std::size_t address) {
+    const auto& memory = state.machine.memory;
+    auto block = std::make_unique<Block>();
+
+    std::vector<std::size_t> addresses;
+    for (auto pc = address; pc < memory.size() && addresses.size() < MAX_BLOCK_INSTRUCTIONS;
+         pc += 2) {
+        addresses.push_back(pc);
+        const std::uint16_t opcode =
+            pc + 1 < memory.size() ? memory[pc] << 8 | memory[pc + 1] : 0;
+        // end at stores as well so the dispatcher can drop the block if it wrote to itself
+        block->store_length = StoreLength(opcode);
+        if (block->store_length || Branches(opcode))
+            break;
+    }
+    // LD Vx, DT peeks at the two instructions after it to find timer polls
+    block->begin = address;
+    block->end = std::min<std::size_t>(addresses.back() + 6, memory.size());
+
+    const auto name = fmt::format("block_{:03X}", address);
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = IREmitter(*context).EmitBlock(memory, addresses, name);
+    module->setDataLayout(jit->getDataLayout());
+    module->setTargetTriple(jit->getTargetTriple().str());
+    Optimize(*module, target_machine.get());
+
+    block->tracker = jit->getMainJITDylib().createResourceTracker();
+    if (auto error = jit->addIRModule(
+            block->tracker, llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))) {
+        fmt::print("{}\n", llvm::toString(std::move(error)));
+        return nullptr;
+    }
+    auto symbol = jit->lookup(name);
+    if (!symbol) {
+        fmt::print("{}\n", llvm::toString(symbol.takeError()));
+        return nullptr;
+    }
+    // lookups return an ExecutorAddr since LLVM 15, a JITEvaluatedSymbol before that
+#if LLVM_VERSION_MAJOR >= 15
+    block->entry = symbol->toPtr<Entry>();
+#else
+    block->entry = reinterpret_cast<Entry>(symbol->getAddress());
+#endif
+
+    for (auto i = block->begin; i < block->end; i++)
+        compiled_code[i] = true;
+    compiled_blocks++;
+    return (blocks[address] = std::move(block)).get();
+}
+
+void Recompiler::Invalidate(std::size_t address, std::size_t length) {
+    std::bitset<0x1000> written;
+    for (std::size_t i = 0; i < length; i++)
+        written[(address + i) & 0xFFF] = true;
+    // most stores go to data
+    if ((written & compiled_code).none())
+        return;
+
+    compiled_code.reset();
+    for (auto& block : blocks) {
+        if (!block)
+            continue;
+        bool overwritten = false;
+        for (auto i = block->begin; i < block->end && !overwritten; i++)
+            overwritten = written[i];
+        if (overwritten) {
+            // frees the code of the block, which isn't running, stores end their blocks
+            if (auto error = block->tracker->remove())
+                fmt::print("{}\n", llvm::toString(std::move(error)));
+            block.reset();
+            invalidated_blocks++;
+            continue;
+        }
+        for (auto i = block->begin; i < block->end; i++)
+            compiled_code[i] = true;
+    }
+}
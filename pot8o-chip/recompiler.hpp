@@ -0,0 +1,70 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+
+#include "chip8.hpp"
+
+namespace llvm {
+class TargetMachine;
+namespace orc {
+class LLJIT;
+class ResourceTracker;
+} // namespace orc
+} // namespace llvm
+
+// Compiles blocks of code with LLVM the first time they run and caches them by address
+// Unlike LLVMAOT it follows games that jump into data or write to their own code, stores into
+// compiled code drop the blocks generated from it
+class Recompiler final : public Chip8::CPU {
+public:
+    Recompiler();
+    ~Recompiler() override;
+
+    void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+
+    // machine state the compiled blocks run on, mirrored by IREmitter::state_type
+    struct State {
+        Chip8::Snapshot machine;
+        std::uint32_t rand;
+        // instructions run and not added to the cycle count of the interface yet
+        std::uint64_t cycles;
+    };
+    // runs until control leaves the block, then stores where to continue in the program counter
+    using Entry = void (*)(Chip8::Interface* interface, State* state);
+
+private:
+    struct Block {
+        Entry entry = nullptr;
+        // range of memory the code was generated from
+        std::size_t begin = 0, end = 0;
+        // bytes written at I by the store ending the block, 0 if it doesn't end in one
+        std::size_t store_length = 0;
+        // owns the code of the block in the JIT, removing it frees the code
+        llvm::IntrusiveRefCntPtr<llvm::orc::ResourceTracker> tracker;
+    };
+
+    // Generate and compile the block starting at address from the current memory, nullptr if the
+    // JIT failed to
+    Block* Compile(std::size_t address);
+    // Drop every block generated from the length bytes at address
+    void Invalidate(std::size_t address, std::size_t length);
+
+    static constexpr std::size_t MAX_BLOCK_INSTRUCTIONS = 0x40;
+
+    State state{};
+    // declared before the blocks so it outlives their trackers, every block is a module of its own
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+    // compiled blocks by their first address, blocks can overlap
+    std::array<std::unique_ptr<Block>, 0x1000> blocks;
+    // bytes at least one compiled block was generated from
+    std::bitset<0x1000> compiled_code;
+
+    std::uint64_t compiled_blocks = 0;
+    std::uint64_t invalidated_blocks = 0;
+};
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <iterator>
+
+#include "sessions.hpp"
+
+Sessions::Sessions(std::size_t threads, std::uint64_t ticks_per_slice)
+    : ticks_per_slice{std::max<std::uint64_t>(ticks_per_slice, 1)} {
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (std::size_t i = 0; i < threads; i++)
+        workers.push_back(std::make_unique<Worker>());
+    for (std::size_t i = 0; i < threads; i++)
+        this->threads.emplace_back([this, i] { RunWorker(i); });
+    wheel_thread = std::thread([this] { RunWheel(); });
+}
+
+Sessions::~Sessions() {
+    {
+        std::lock_guard lock{idle_mutex};
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    wheel_thread->join();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+std::optional<Sessions::Id> Sessions::Add(std::unique_ptr<Chip8::CPU> cpu,
+                                          std::vector<std::uint8_t> game,
+                                          std::uint64_t instructions_per_tick, std::uint32_t seed,
+                                          FrameCallback on_frame) {
+    auto session = std::make_shared<Session>(std::move(cpu), std::move(on_frame));
+    if (!session->chip8.Load(std::move(game), instructions_per_tick, seed))
+        return std::nullopt;
+    Id id;
+    {
+        std::lock_guard lock{sessions_mutex};
+        id = next_id++;
+        sessions.emplace(id, session);
+    }
+    std::lock_guard lock{wheel_mutex};
+    session->clock = now;
+    session->due = now + ticks_per_slice;
+    wheel[session->due % WHEEL_SLOTS].push_back(std::move(session));
+    return id;
+}
+
+void Sessions::Remove(Id id) {
+    std::shared_ptr<Session> session;
+    {
+        std::lock_guard lock{sessions_mutex};
+        const auto found = sessions.find(id);
+        if (found == sessions.end())
+            return;
+        session = std::move(found->second);
+        sessions.erase(found);
+    }
+    {
+        std::lock_guard lock{session->mutex};
+        session->state = Session::State::Removed;
+    }
+    // the wheel and the queues drop it once they get to it
+    std::lock_guard lock{session->run_mutex};
+}
+
+void Sessions::SetKey(Id id, std::size_t key, bool val) {
+    std::shared_ptr<Session> session;
+    {
+        std::lock_guard lock{sessions_mutex};
+        const auto found = sessions.find(id);
+        if (found == sessions.end())
+            return;
+        session = found->second;
+    }
+    std::lock_guard lock{session->mutex};
+    if (session->state == Session::State::Ended || session->state == Session::State::Removed)
+        return;
+    session->keys.emplace_back(key, val);
+    if (session->state != Session::State::Waiting)
+        return;
+
+    // nothing happened while it waited, so it picks up at the last tick instead of making up for
+    // all of them
+    session->state = Session::State::Scheduled;
+    {
+        std::lock_guard wheel_lock{wheel_mutex};
+        if (session->clock < now) {
+            session->stats.dropped_ticks += now - 1 - session->clock;
+            session->clock = now - 1;
+        }
+        session->due = session->clock + 1;
+    }
+    Schedule(std::move(session), id % workers.size());
+}
+
+std::optional<Sessions::Stats> Sessions::GetStats(Id id) {
+    std::shared_ptr<Session> session;
+    {
+        std::lock_guard lock{sessions_mutex};
+        const auto found = sessions.find(id);
+        if (found == sessions.end())
+            return std::nullopt;
+        session = found->second;
+    }
+    std::lock_guard lock{session->mutex};
+    return session->stats;
+}
+
+void Sessions::RunWheel() {
+    using Clock = std::chrono::steady_clock;
+    const auto period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1. / 60.));
+    auto deadline = Clock::now();
+    std::vector<std::shared_ptr<Session>> due;
+    while (!stopping) {
+        deadline += period;
+        std::this_thread::sleep_until(deadline);
+        // after a stall every session falls behind by the same ticks instead of running them
+        // back to back
+        if (Clock::now() - deadline > period)
+            deadline = Clock::now();
+        {
+            std::lock_guard lock{wheel_mutex};
+            now++;
+            auto& slot = wheel[now % WHEEL_SLOTS];
+            // sessions a turn of the wheel or more away stay in their slot
+            const auto later = std::partition(
+                slot.begin(), slot.end(), [&](const auto& session) { return session->due > now; });
+            due.assign(std::make_move_iterator(later), std::make_move_iterator(slot.end()));
+            slot.erase(later, slot.end());
+        }
+        for (auto& session : due) {
+            Enqueue(std::move(session), next_worker);
+            next_worker = (next_worker + 1) % workers.size();
+        }
+        due.clear();
+    }
+}
+
+void Sessions::RunWorker(std::size_t self) {
+    while (!stopping) {
+        if (const auto session = Dequeue(self)) {
+            RunSlice(session, self);
+            continue;
+        }
+        std::unique_lock lock{idle_mutex};
+        idle_cv.wait(lock, [&] { return queued != 0 || stopping; });
+    }
+}
+
+void Sessions::RunSlice(const std::shared_ptr<Session>& session, std::size_t self) {
+    std::lock_guard run_lock{session->run_mutex};
+    std::vector<std::pair<std::size_t, bool>> keys;
+    {
+        std::lock_guard lock{session->mutex};
+        if (session->state != Session::State::Scheduled)
+            return;
+        keys.swap(session->keys);
+    }
+    std::uint64_t ticks;
+    std::uint64_t dropped = 0;
+    {
+        std::lock_guard lock{wheel_mutex};
+        ticks = now - session->clock;
+        if (ticks > ticks_per_slice + MAX_LAG) {
+            dropped = ticks - ticks_per_slice - MAX_LAG;
+            ticks -= dropped;
+        }
+        session->clock = now;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto& chip8 = session->chip8;
+    bool running = true;
+    // keys came in at the last of the ticks, not at the first one a late session makes up for
+    if (ticks > 1)
+        running = chip8.RunFor(ticks - 1, session->on_frame);
+    for (auto [key, val] : keys)
+        chip8.SetKey(key, val);
+    if (running && ticks != 0)
+        running = chip8.RunFor(1, session->on_frame);
+    const auto instructions = chip8.GetCycles();
+    const auto busy = std::chrono::steady_clock::now() - start;
+
+    std::unique_lock lock{session->mutex};
+    auto& stats = session->stats;
+    stats.ticks += ticks;
+    stats.instructions += instructions;
+    stats.slices++;
+    stats.dropped_ticks += dropped;
+    stats.busy += std::chrono::duration_cast<std::chrono::nanoseconds>(busy);
+    if (session->state == Session::State::Removed)
+        return;
+    if (!running) {
+        session->state = Session::State::Ended;
+        stats.ended = true;
+        const auto tick = stats.ticks;
+        lock.unlock();
+        // a game that ended partway through a tick still shows what it drew last
+        chip8.ConsumeFrameBuffer(
+            [&](const Chip8::Frame& frame) { session->on_frame(tick, frame); });
+        return;
+    }
+    // only a key can wake it up, SetKey puts it back on the wheel
+    if (ticks != 0 && chip8.WaitsForKey() && session->keys.empty()) {
+        session->state = Session::State::Waiting;
+        return;
+    }
+    session->due = session->clock + ticks_per_slice;
+    Schedule(session, self);
+}
+
+void Sessions::Schedule(std::shared_ptr<Session> session, std::size_t worker) {
+    {
+        std::lock_guard lock{wheel_mutex};
+        if (session->due > now) {
+            wheel[session->due % WHEEL_SLOTS].push_back(std::move(session));
+            return;
+        }
+    }
+    Enqueue(std::move(session), worker);
+}
+
+void Sessions::Enqueue(std::shared_ptr<Session> session, std::size_t worker) {
+    // counted first so that a worker taking it right away never sees the count go below 0
+    {
+        std::lock_guard lock{idle_mutex};
+        queued++;
+    }
+    {
+        std::lock_guard lock{workers[worker]->mutex};
+        workers[worker]->queue.push_back(std::move(session));
+    }
+    idle_cv.notify_one();
+}
+
+std::shared_ptr<Sessions::Session> Sessions::Dequeue(std::size_t self) {
+    std::shared_ptr<Session> session;
+    // oldest first everywhere, so stealing doesn't let later sessions overtake earlier ones
+    for (std::size_t i = 0; i < workers.size() && !session; i++) {
+        auto& worker = *workers[(self + i) % workers.size()];
+        std::lock_guard lock{worker.mutex};
+        if (worker.queue.empty())
+            continue;
+        session = std::move(worker.queue.front());
+        worker.queue.pop_front();
+    }
+    if (session) {
+        std::lock_guard lock{idle_mutex};
+        queued--;
+    }
+    return session;
+}
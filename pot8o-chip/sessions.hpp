@@ -0,0 +1,122 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "chip8.hpp"
+
+// Runs many games at once in real time on a fixed pool of threads instead of two threads each
+// Every session is a stepped Chip8 that gets a slice of ticks_per_slice 60 Hz ticks whenever a
+// single timer wheel finds it due. Due sessions queue up on the workers first come first served
+// and idle workers steal from busy ones. A session stuck in a wait only a key can end leaves the
+// wheel until one comes in
+class Sessions {
+public:
+    using Id = std::uint64_t;
+    using FrameCallback = std::function<void(std::uint64_t tick, const Chip8::Frame& frame)>;
+
+    // totals since the session was added
+    struct Stats {
+        std::uint64_t ticks = 0;
+        std::uint64_t instructions = 0;
+        std::uint64_t slices = 0;
+        // ticks skipped because the session fell too far behind or waited on a key
+        std::uint64_t dropped_ticks = 0;
+        // time workers spent running it
+        std::chrono::nanoseconds busy{};
+        bool ended = false;
+    };
+
+    // threads workers, 0 for one per core
+    explicit Sessions(std::size_t threads = 0, std::uint64_t ticks_per_slice = 1);
+    ~Sessions();
+    Sessions(const Sessions&) = delete;
+    Sessions& operator=(const Sessions&) = delete;
+
+    // Start the game on cpu in virtual time with instructions_per_tick instructions every tick,
+    // nullopt if the CPU can't be stepped
+    // on_frame gets the frame of every tick on whichever worker ran it, one at a time, and the
+    // last one the game drew if it ends
+    std::optional<Id> Add(std::unique_ptr<Chip8::CPU> cpu, std::vector<std::uint8_t> game,
+                          std::uint64_t instructions_per_tick, std::uint32_t seed,
+                          FrameCallback on_frame);
+    // Drop the session, waits for a slice it is running to end
+    void Remove(Id id);
+    // the session sees the key from its next tick on
+    void SetKey(Id id, std::size_t key, bool val);
+    std::optional<Stats> GetStats(Id id);
+
+private:
+    // enough to tell ticks apart for slices up to this long
+    static constexpr std::size_t WHEEL_SLOTS = 64;
+    // how far past its slice a session can fall behind before the rest gets dropped, 100 ms
+    static constexpr std::uint64_t MAX_LAG = 6;
+
+    struct Session {
+        Session(std::unique_ptr<Chip8::CPU> cpu, FrameCallback on_frame)
+            : chip8{std::move(cpu)}, on_frame{std::move(on_frame)} {}
+
+        Chip8 chip8;
+        FrameCallback on_frame;
+        // wheel tick the session ran up to and the one its next slice is due at, set by the
+        // worker running it, or by SetKey while it waits, under wheel_mutex
+        std::uint64_t clock = 0, due = 0;
+
+        // held by the worker running a slice
+        std::mutex run_mutex;
+        // guards everything below
+        std::mutex mutex;
+        enum class State { Scheduled, Waiting, Ended, Removed } state = State::Scheduled;
+        // keys set since the last slice
+        std::vector<std::pair<std::size_t, bool>> keys;
+        Stats stats;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<Session>> queue;
+    };
+
+    void RunWheel();
+    void RunWorker(std::size_t self);
+    // Run the ticks the session is owed and put it back on the wheel
+    void RunSlice(const std::shared_ptr<Session>& session, std::size_t self);
+    // Put the session on the wheel for its due tick, straight into a queue if it is already due
+    void Schedule(std::shared_ptr<Session> session, std::size_t worker);
+    void Enqueue(std::shared_ptr<Session> session, std::size_t worker);
+    // from our own queue, else stolen from another
+    std::shared_ptr<Session> Dequeue(std::size_t self);
+
+    const std::uint64_t ticks_per_slice;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::optional<std::thread> wheel_thread;
+
+    std::mutex wheel_mutex;
+    std::array<std::vector<std::shared_ptr<Session>>, WHEEL_SLOTS> wheel;
+    // ticks since the start, guarded by wheel_mutex
+    std::uint64_t now = 0;
+    // the worker the wheel hands the next due session to
+    std::size_t next_worker = 0;
+
+    // sessions sitting in worker queues, workers sleep on idle_cv while there are none
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    std::size_t queued = 0;
+    std::atomic_bool stopping = false;
+
+    std::mutex sessions_mutex;
+    std::unordered_map<Id, std::shared_ptr<Session>> sessions;
+    Id next_id = 0;
+};
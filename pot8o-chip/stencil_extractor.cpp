@@ -0,0 +1,180 @@
+// Build time tool cutting the stencil_<name> functions out of the object compiled from
+// stencils.cpp, writing their machine code and the relocations against the holes in them as a
+// header for copy_patch.cpp
+// usage: stencil_extractor stencils.o stencils.inc
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <llvm/BinaryFormat/ELF.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Object/ObjectFile.h>
+
+namespace {
+constexpr llvm::StringRef STENCIL_PREFIX = "stencil_", HOLE_PREFIX = "HOLE_";
+
+[[noreturn]] void Fail(const std::string& message) {
+    fmt::print(stderr, "stencil_extractor: {}\n", message);
+    std::exit(1);
+}
+
+template <typename T>
+T Check(llvm::Expected<T> value) {
+    if (!value)
+        Fail(llvm::toString(value.takeError()));
+    return std::move(*value);
+}
+
+llvm::StringRef Contents(const llvm::object::SectionRef& section) {
+    // sections return their contents instead of an error code since LLVM 9
+#if LLVM_VERSION_MAJOR >= 9
+    return Check(section.getContents());
+#else
+    llvm::StringRef contents;
+    if (section.getContents(contents))
+        Fail("can't read section contents");
+    return contents;
+#endif
+}
+
+llvm::object::section_iterator RelocatedSection(const llvm::object::SectionRef& section) {
+    // an Expected since LLVM 10
+#if LLVM_VERSION_MAJOR >= 10
+    return Check(section.getRelocatedSection());
+#else
+    return section.getRelocatedSection();
+#endif
+}
+
+// CopyPatch::Relocation for an x86-64 relocation type
+std::string Relocation(std::uint64_t type) {
+    switch (type) {
+    case llvm::ELF::R_X86_64_8:
+        return "ABS8";
+    case llvm::ELF::R_X86_64_16:
+        return "ABS16";
+    case llvm::ELF::R_X86_64_32:
+    case llvm::ELF::R_X86_64_32S:
+        return "ABS32";
+    case llvm::ELF::R_X86_64_64:
+        return "ABS64";
+    case llvm::ELF::R_X86_64_PC32:
+    case llvm::ELF::R_X86_64_PLT32:
+        return "PC32";
+    default:
+        return "";
+    }
+}
+
+// CopyPatch::Hole for a symbol a stencil refers to, empty for anything else
+std::string Hole(llvm::StringRef symbol) {
+    if (symbol.startswith(HOLE_PREFIX))
+        return symbol.drop_front(HOLE_PREFIX.size()).str();
+    if (symbol == "memcpy")
+        return "MEMCPY";
+    if (symbol == "memset")
+        return "MEMSET";
+    return "";
+}
+
+bool IsContinuation(const std::string& hole) {
+    return hole == "NEXT" || hole == "SKIP" || hole == "JUMP";
+}
+
+struct Patch {
+    std::uint64_t offset;
+    std::string hole;
+    std::string relocation;
+    std::int64_t addend;
+};
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc != 3)
+        Fail("usage: stencil_extractor stencils.o stencils.inc");
+    auto binary = Check(llvm::object::ObjectFile::createObjectFile(argv[1]));
+    const auto& object = *binary.getBinary();
+    if (object.getArch() != llvm::Triple::x86_64 || !object.isELF())
+        Fail("stencils have to be compiled for x86-64 ELF");
+
+    // relocations by the section they patch
+    std::map<llvm::object::SectionRef, std::vector<llvm::object::RelocationRef>> relocations;
+    for (const auto& section : object.sections()) {
+        const auto target = RelocatedSection(section);
+        if (target == object.section_end())
+            continue;
+        for (const auto& relocation : section.relocations())
+            relocations[*target].push_back(relocation);
+    }
+
+    std::string output = "// generated by stencil_extractor from stencils.cpp, do not edit\n";
+    for (const auto& symbol : object.symbols()) {
+        const auto name = Check(symbol.getName());
+        if (!name.startswith(STENCIL_PREFIX) ||
+            Check(symbol.getType()) != llvm::object::SymbolRef::ST_Function)
+            continue;
+        const auto stencil = name.drop_front(STENCIL_PREFIX.size()).str();
+        const auto section = *Check(symbol.getSection());
+        const auto begin = Check(symbol.getValue());
+        const auto size = llvm::object::ELFSymbolRef(symbol).getSize();
+        const auto code = Contents(section).substr(begin, size);
+
+        std::vector<Patch> patches;
+        for (const auto& relocation : relocations[section]) {
+            if (relocation.getOffset() < begin || relocation.getOffset() >= begin + size)
+                continue;
+            const auto target = relocation.getSymbol();
+            const auto target_name =
+                target == object.symbol_end() ? llvm::StringRef() : Check(target->getName());
+            Patch patch{relocation.getOffset() - begin, Hole(target_name),
+                        Relocation(relocation.getType()),
+                        Check(llvm::object::ELFRelocationRef(relocation).getAddend())};
+            // constant pools and jump tables would have to be copied along with the stencil
+            if (patch.hole.empty())
+                Fail(fmt::format("stencil_{} refers to {}, which isn't a hole", stencil,
+                                 target_name.empty() ? "a section" : target_name.str()));
+            if (patch.relocation.empty())
+                Fail(fmt::format("stencil_{} has an unsupported relocation of type {}", stencil,
+                                 relocation.getType()));
+            if (IsContinuation(patch.hole)) {
+                // jmp rel32 or jcc rel32
+                const auto jump = patch.offset >= 1 && std::uint8_t(code[patch.offset - 1]) == 0xE9;
+                const auto branch = patch.offset >= 2 && std::uint8_t(code[patch.offset - 2]) == 0x0F &&
+                                    (std::uint8_t(code[patch.offset - 1]) & 0xF0) == 0x80;
+                if (patch.relocation != "PC32" || !(jump || branch))
+                    Fail(fmt::format("stencil_{} has to jump to HOLE_{}, not call it", stencil,
+                                     patch.hole));
+            }
+            patches.push_back(patch);
+        }
+
+        const auto falls_through = std::any_of(patches.begin(), patches.end(), [&](auto& patch) {
+            return patch.hole == "NEXT" && patch.offset + 4 == size &&
+                   std::uint8_t(code[size - 5]) == 0xE9;
+        });
+
+        output += fmt::format("static constexpr std::uint8_t {}_code[]{{", stencil);
+        for (const auto byte : code)
+            output += fmt::format("{:#04x},", std::uint8_t(byte));
+        output += fmt::format("}};\nstatic constexpr std::array<Patch, {}> {}_patches{{{{",
+                              patches.size(), stencil);
+        for (const auto& patch : patches)
+            output += fmt::format("{{{}, Hole::{}, Relocation::{}, {}}},", patch.offset,
+                                  patch.hole, patch.relocation, patch.addend);
+        output += fmt::format("}}}};\nstatic constexpr Stencil {0}_stencil{{{0}_code, "
+                              "sizeof({0}_code), {0}_patches.data(), {0}_patches.size(), {1}}};\n",
+                              stencil, falls_through);
+    }
+
+    auto file = std::fopen(argv[2], "w");
+    if (!file || std::fputs(output.c_str(), file) < 0 || std::fclose(file))
+        Fail(fmt::format("can't write {}", argv[2]));
+    return 0;
+}
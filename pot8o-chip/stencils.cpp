@@ -0,0 +1,369 @@
+// Compiled at build time into the machine code CopyPatch copies for each instruction, never linked
+// into pot8o-chip itself
+// Holes are undefined symbols, so the compiler leaves a relocation wherever an operand or the
+// code to continue at goes and stencil_extractor turns those into patches. Operands come out as
+// immediates and continuations as tail jumps, which only works with -O2 -fno-pic -mcmodel=small
+// Same semantics as IREmitter
+
+#include <cstdint>
+
+#include "copy_patch.hpp"
+
+using State = CopyPatch::State;
+
+extern "C" {
+extern const char HOLE_X, HOLE_Y, HOLE_N, HOLE_KK, HOLE_NNN, HOLE_PC, HOLE_COUNT;
+void HOLE_NEXT(Chip8::Interface* interface, State* state);
+void HOLE_SKIP(Chip8::Interface* interface, State* state);
+void HOLE_JUMP(Chip8::Interface* interface, State* state);
+}
+
+#define OPERAND(hole) static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(&HOLE_##hole))
+
+#define STENCIL(name)                                                                              \
+    extern "C" void stencil_##name(Chip8::Interface* interface, State* state)
+
+// the continuation has to be a jump, a call would leave a return address behind on every
+// instruction
+#if defined(__has_cpp_attribute) && __has_cpp_attribute(clang::musttail)
+#define TAIL_CALL [[clang::musttail]]
+#else
+#define TAIL_CALL
+#endif
+#define CONTINUE(hole) TAIL_CALL return HOLE_##hole(interface, state)
+
+// hand the program counter back to CopyPatch::Run
+#define LEAVE(address)                                                                             \
+    do {                                                                                           \
+        state->machine.program_counter = (address);                                                \
+        return;                                                                                    \
+    } while (false)
+
+#define V state->machine.V
+#define Vx V[OPERAND(X)]
+#define Vy V[OPERAND(Y)]
+
+static inline bool Stopping(Chip8::Interface* interface) {
+    return interface->stop_flag.load(std::memory_order_relaxed);
+}
+
+static inline void PublishCycles(Chip8::Interface* interface, State* state) {
+    interface->cycle_count.fetch_add(state->cycles, std::memory_order_relaxed);
+    state->cycles = 0;
+}
+
+// jumps hand the count to the frontend once the budget is used up, then wait for the next tick
+// if throttled
+static inline void CheckCycles(Chip8::Interface* interface, State* state) {
+    if (__builtin_expect(state->cycles >= interface->instruction_budget, 0)) {
+        PublishCycles(interface, state);
+        interface->wait_for_tick(*interface);
+    }
+}
+
+static inline void PushFrame(Chip8::Interface* interface, State* state) {
+    if (interface->send_frame)
+        interface->PushFrameBuffer(state->machine.frame_buffer);
+}
+
+// stores into compiled code go back to Run to have it generated again
+static inline bool Overwrote(State* state, std::uint32_t address, std::uint32_t length) {
+    bool overwrote = false;
+    for (std::uint32_t i = 0; i < length; i++)
+        overwrote |= state->compiled[(address + i) & 0xFFF];
+    return overwrote;
+}
+
+// targets only known at runtime go through the table of compiled code, loops through RET and
+// JP V0 notice stops here
+#define GO_TO(target)                                                                              \
+    do {                                                                                           \
+        const std::uint32_t address = (target);                                                    \
+        if (address < 0x1000 && state->code[address] && !Stopping(interface))                      \
+            TAIL_CALL return state->code[address](interface, state);                               \
+        LEAVE(address);                                                                            \
+    } while (false)
+
+STENCIL(NOOP) {
+    CONTINUE(NEXT);
+}
+
+// in front of the first instruction of every block, NEXT is that instruction
+STENCIL(COUNT) {
+    state->cycles += OPERAND(COUNT);
+    CONTINUE(NEXT);
+}
+
+STENCIL(CLS) {
+    for (auto& row : state->machine.frame_buffer)
+        row = 0;
+    PushFrame(interface, state);
+    CONTINUE(NEXT);
+}
+
+STENCIL(RET) {
+    CheckCycles(interface, state);
+    auto& machine = state->machine;
+    GO_TO(machine.stack[--machine.stack_ptr & 0xF] + 2);
+}
+
+STENCIL(JP_addr) {
+    CheckCycles(interface, state);
+    // every loop without a RET or JP V0 in it goes through a JP or CALL
+    if (Stopping(interface))
+        LEAVE(OPERAND(NNN));
+    CONTINUE(JUMP);
+}
+
+// programs often jump to pc when done executing, keep pushing the last frame until stopped
+STENCIL(END) {
+    for (;;) {
+        PushFrame(interface, state);
+        // paces the loop when throttled and keeps virtual time going
+        interface->wait_for_tick(*interface);
+        if (Stopping(interface))
+            LEAVE(OPERAND(PC));
+    }
+}
+
+STENCIL(CALL_addr) {
+    CheckCycles(interface, state);
+    auto& machine = state->machine;
+    machine.stack[machine.stack_ptr++ & 0xF] = OPERAND(PC);
+    if (Stopping(interface))
+        LEAVE(OPERAND(NNN));
+    CONTINUE(JUMP);
+}
+
+STENCIL(SE_Vx_byte) {
+    if (Vx == static_cast<std::uint8_t>(OPERAND(KK)))
+        CONTINUE(SKIP);
+    CONTINUE(NEXT);
+}
+
+STENCIL(SNE_Vx_byte) {
+    if (Vx != static_cast<std::uint8_t>(OPERAND(KK)))
+        CONTINUE(SKIP);
+    CONTINUE(NEXT);
+}
+
+STENCIL(SE_Vx_Vy) {
+    if (Vx == Vy)
+        CONTINUE(SKIP);
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_Vx_byte) {
+    Vx = OPERAND(KK);
+    CONTINUE(NEXT);
+}
+
+STENCIL(ADD_Vx_byte) {
+    Vx += OPERAND(KK);
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_Vx_Vy) {
+    Vx = Vy;
+    CONTINUE(NEXT);
+}
+
+STENCIL(OR_Vx_Vy) {
+    Vx |= Vy;
+    CONTINUE(NEXT);
+}
+
+STENCIL(AND_Vx_Vy) {
+    Vx &= Vy;
+    CONTINUE(NEXT);
+}
+
+STENCIL(XOR_Vx_Vy) {
+    Vx ^= Vy;
+    CONTINUE(NEXT);
+}
+
+STENCIL(ADD_Vx_Vy) {
+    const std::uint8_t x = Vx;
+    const std::uint8_t sum = x + Vy;
+    // the carry lands in VF first, so the sum wins for ADD VF, Vy
+    V[0xF] = sum < x;
+    Vx = sum;
+    CONTINUE(NEXT);
+}
+
+STENCIL(SUB_Vx_Vy) {
+    const std::uint8_t x = Vx, y = Vy;
+    Vx = x - y;
+    V[0xF] = x >= y;
+    CONTINUE(NEXT);
+}
+
+STENCIL(SHR_Vx) {
+    V[0xF] = Vx & 1;
+    Vx >>= 1;
+    CONTINUE(NEXT);
+}
+
+STENCIL(SUBN_Vx_Vy) {
+    const std::uint8_t x = Vx, y = Vy;
+    Vx = y - x;
+    V[0xF] = y >= x;
+    CONTINUE(NEXT);
+}
+
+STENCIL(SHL_Vx) {
+    V[0xF] = Vx >> 7;
+    Vx <<= 1;
+    CONTINUE(NEXT);
+}
+
+STENCIL(SNE_Vx_Vy) {
+    if (Vx != Vy)
+        CONTINUE(SKIP);
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_I_addr) {
+    state->machine.I = OPERAND(NNN);
+    CONTINUE(NEXT);
+}
+
+STENCIL(JP_V0_addr) {
+    CheckCycles(interface, state);
+    GO_TO(OPERAND(NNN) + V[0x0]);
+}
+
+STENCIL(RND_Vx_byte) {
+    auto rand = state->rand;
+    rand ^= rand << 13;
+    rand ^= rand >> 17;
+    rand ^= rand << 5;
+    state->rand = rand;
+    Vx = rand & OPERAND(KK);
+    CONTINUE(NEXT);
+}
+
+STENCIL(DRW_Vx_Vy_nibble) {
+    auto& machine = state->machine;
+    const std::uint32_t left = (Vx + 8) & 63;
+    const std::uint32_t top = Vy;
+    std::uint64_t flag = 0;
+
+    for (std::uint32_t row = 0; row < OPERAND(N); row++) {
+        auto& fb_row = machine.frame_buffer[(top + row) & 31];
+        const std::uint64_t sprite = machine.memory[(machine.I + row) & 0xFFF];
+        const auto sprite_row = sprite >> left | sprite << (-left & 63);
+        flag |= fb_row & sprite_row;
+        fb_row ^= sprite_row;
+    }
+    V[0xF] = flag != 0;
+
+    PushFrame(interface, state);
+    CONTINUE(NEXT);
+}
+
+STENCIL(SKP_Vx) {
+    if (interface->keypad_state.load(std::memory_order_relaxed) >> (Vx & 0xF) & 1)
+        CONTINUE(SKIP);
+    CONTINUE(NEXT);
+}
+
+STENCIL(SKNP_Vx) {
+    if (!(interface->keypad_state.load(std::memory_order_relaxed) >> (Vx & 0xF) & 1))
+        CONTINUE(SKIP);
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_Vx_DT) {
+    Vx = interface->delay_timer.load(std::memory_order_relaxed);
+    CONTINUE(NEXT);
+}
+
+// LD Vx, DT; SE/SNE Vx, kk; JP back to the LD, with kk patched in from the skip, parked on the
+// timer thread instead of spinning
+#define TIMER_POLL(name, wake)                                                                     \
+    STENCIL(name) {                                                                                \
+        for (;;) {                                                                                 \
+            const std::uint32_t seen = interface->event_count.load(std::memory_order_acquire);    \
+            Vx = interface->delay_timer.load(std::memory_order_relaxed);                          \
+            if ((wake) || Stopping(interface))                                                     \
+                break;                                                                             \
+            PublishCycles(interface, state);                                                       \
+            interface->wait_for_event(*interface, seen);                                           \
+        }                                                                                          \
+        CONTINUE(NEXT);                                                                            \
+    }
+TIMER_POLL(LD_Vx_DT_SE_idle, Vx == static_cast<std::uint8_t>(OPERAND(KK)))
+TIMER_POLL(LD_Vx_DT_SNE_idle, Vx != static_cast<std::uint8_t>(OPERAND(KK)))
+
+STENCIL(LD_Vx_K) {
+    std::uint32_t keys;
+    while (!(keys = interface->keypad_state.load(std::memory_order_relaxed))) {
+        // retried if the game is ever resumed
+        if (Stopping(interface))
+            LEAVE(OPERAND(PC));
+        PublishCycles(interface, state);
+        interface->wait_for_key(*interface);
+    }
+    Vx = __builtin_ctz(keys);
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_DT_Vx) {
+    interface->delay_timer.store(Vx, std::memory_order_relaxed);
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_ST_Vx) {
+    interface->sound_timer.store(Vx, std::memory_order_relaxed);
+    CONTINUE(NEXT);
+}
+
+STENCIL(ADD_I_Vx) {
+    state->machine.I += Vx;
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_F_Vx) {
+    state->machine.I = Vx * 5;
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_B_Vx) {
+    auto& machine = state->machine;
+    const auto address = machine.I;
+    const std::uint8_t num = Vx;
+    machine.memory[address & 0xFFF] = num / 100;
+    machine.memory[(address + 1) & 0xFFF] = num % 100 / 10;
+    machine.memory[(address + 2) & 0xFFF] = num % 10;
+    if (Overwrote(state, address, 3)) {
+        state->invalidated = true;
+        LEAVE(OPERAND(PC) + 2);
+    }
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_I_Vx) {
+    auto& machine = state->machine;
+    const auto address = machine.I;
+    for (std::uint32_t i = 0; i <= OPERAND(X); i++)
+        machine.memory[(address + i) & 0xFFF] = V[i];
+    if (Overwrote(state, address, OPERAND(X) + 1)) {
+        state->invalidated = true;
+        LEAVE(OPERAND(PC) + 2);
+    }
+    CONTINUE(NEXT);
+}
+
+STENCIL(LD_Vx_I) {
+    auto& machine = state->machine;
+    for (std::uint32_t i = 0; i <= OPERAND(X); i++)
+        V[i] = machine.memory[(machine.I + i) & 0xFFF];
+    CONTINUE(NEXT);
+}
+
+// where jumps out of the compiled code go
+STENCIL(EXIT) {
+    LEAVE(OPERAND(PC));
+}
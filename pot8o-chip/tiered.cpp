@@ -0,0 +1,93 @@
+#include <chrono>
+
+#include <fmt/format.h>
+
+#include "tiered.hpp"
+
+Tiered::~Tiered() {
+    JoinCompiler();
+}
+
+void Tiered::JoinCompiler() {
+    if (compiler.joinable())
+        compiler.join();
+}
+
+void Tiered::Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) {
+    const auto start = std::chrono::steady_clock::now();
+    JoinCompiler();
+    native = false;
+    interpreter.Load(interface, game);
+
+    interpreting = true;
+    compiled = false;
+    entry = nullptr;
+    compiler = std::thread([this, &interface, game] {
+        const auto compiled_entry = aot.Compile(game);
+        std::lock_guard lock{switch_mutex};
+        compiled = true;
+        entry = compiled_entry;
+        // the game already stopped, and interface may be gone with it
+        if (!interpreting)
+            return;
+        interpreter.Yield();
+        // kick the interpreter out of a timer or key wait so it reaches the safe point sooner
+        interface.switching = true;
+        interface.NotifyEvent();
+    });
+    interpreter.Execute();
+    bool switching;
+    {
+        std::lock_guard lock{switch_mutex};
+        interpreting = false;
+        switching = compiled;
+    }
+    interface.switching = false;
+    // Execute also returns before the compile is done if the game stops or leaves memory, the
+    // compile finishes on its own and the next Run waits for it
+    if (!switching)
+        return;
+    JoinCompiler();
+
+    if (!entry) {
+        fmt::print("native compile failed, staying on the interpreter\n");
+        interpreter.Execute();
+        return;
+    }
+
+    // the interpreter can yield at instructions the native code has no label for, like code only
+    // reached through a computed jump the static pass didn't see, so give it a few more
+    // instructions to reach one
+    for (auto attempts = 0; attempts < MAX_SWITCH_ATTEMPTS; attempts++) {
+        const auto snapshot = interpreter.GetSnapshot();
+        if (interface.stop_flag || snapshot.program_counter >= 0x1000)
+            return;
+        if (aot.CanResume(snapshot)) {
+            fmt::print("switched to native code at {:#05X} after {:.3f} s\n",
+                       snapshot.program_counter,
+                       std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                           .count());
+            native = true;
+            entry(&interface, &snapshot, GameSeed(interface));
+            return;
+        }
+        interpreter.Step();
+    }
+
+    // most likely the game modified its own code, which the native code can't follow
+    fmt::print("no safe point to switch to native code, staying on the interpreter\n");
+    interpreter.Execute();
+}
+
+std::optional<Chip8::Snapshot> Tiered::Save() const {
+    if (native)
+        return aot.Save();
+    return interpreter.GetSnapshot();
+}
+
+void Tiered::Resume(Chip8::Interface& interface, std::vector<std::uint8_t> game,
+                    const Chip8::Snapshot& snapshot) {
+    JoinCompiler();
+    native = true;
+    aot.Resume(interface, std::move(game), snapshot);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "chip8.hpp"
+#include "interpreter.hpp"
+#include "llvm_aot.hpp"
+
+// Starts the game on the Interpreter right away and moves it over to LLVMAOT once the compile
+// running on a background thread finishes
+class Tiered final : public Chip8::CPU {
+public:
+    explicit Tiered(Interpreter::Dispatch dispatch = Interpreter::Dispatch::Threaded)
+        : interpreter{dispatch} {}
+    ~Tiered() override;
+
+    void Run(Chip8::Interface& interface, std::vector<std::uint8_t> game) override;
+    // from whichever of the two was running
+    std::optional<Chip8::Snapshot> Save() const override;
+    // Straight on LLVMAOT, an edit only compiles the subroutines it touched
+    void Resume(Chip8::Interface& interface, std::vector<std::uint8_t> game,
+                const Chip8::Snapshot& snapshot) override;
+
+private:
+    static constexpr auto MAX_SWITCH_ATTEMPTS = 0x100;
+
+    // waits for the compile a stopped game left behind, before aot is used again
+    void JoinCompiler();
+
+    Interpreter interpreter;
+    LLVMAOT aot;
+    // compiles its own copy of the game, so it can outlive the Run that started it
+    std::thread compiler;
+    // guards the hand over between the compile and the Run waiting for it
+    std::mutex switch_mutex;
+    // whether Run still waits on the interpreter, the compile leaves it alone after that
+    bool interpreting = false;
+    bool compiled = false;
+    LLVMAOT::Entry entry = nullptr;
+    // whether the game moved over to LLVMAOT
+    bool native = false;
+};